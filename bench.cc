@@ -0,0 +1,613 @@
+/*
+ *  OpenSCAD (www.openscad.at)
+ *  Copyright (C) 2009  Clifford Wolf <clifford@clifford.at>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#define INCLUDE_ABSTRACT_NODE_DETAILS
+
+#include "openscad.h"
+
+#include <QCoreApplication>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <algorithm>
+
+#include <sys/resource.h>
+
+// Benchmark mode: "openscad --benchmark [options] [files]" runs every file
+// through the complete pipeline a number of times with cold caches and
+// reports the time spent in each stage.
+
+static const char *bench_stages[] = {
+  "parse", "evaluate", "csg", "normalize", "cgal", NULL
+};
+
+struct BenchResult {
+  QString file;
+  QHash<QString, QVector<double> > msecs;
+  long peak_rss_kb;
+  int cache_hits;
+  int cache_misses;
+  bool ok;
+
+  BenchResult() : peak_rss_kb(0), cache_hits(0), cache_misses(0), ok(false) {
+  }
+};
+
+static void bench_clear_caches() {
+  {
+    QMutexLocker locker(&AbstractNode::cgal_nef_cache_mutex);
+    AbstractNode::cgal_nef_cache.clear();
+  }
+  {
+    QMutexLocker locker(&AbstractNode::cgal_mesh_cache_mutex);
+    AbstractNode::cgal_mesh_cache.clear();
+  }
+  {
+    QMutexLocker locker(&PolySet::ps_cache_mutex);
+    PolySet::ps_cache.clear();
+  }
+}
+
+static double bench_lap(QElapsedTimer &timer) {
+  double msecs = timer.nsecsElapsed() / 1e6;
+  timer.restart();
+  return msecs;
+}
+
+// One cold run of the pipeline, the same stages as MainWindow::compile()
+// followed by the CGAL rendering.
+static bool bench_run(const QByteArray &source, bool with_cgal, BenchResult &r) {
+  bench_clear_caches();
+  profile_reset();
+
+  CompiledDesign d;
+  Context root_ctx;
+  init_root_ctx(&root_ctx, 0.0);
+
+  QElapsedTimer timer;
+  timer.start();
+
+  d.root_module = parse(source.data(), false);
+  if (!d.root_module)
+    return false;
+  r.msecs["parse"].append(bench_lap(timer));
+
+  AbstractNode::idx_counter = 1;
+  d.root_inst = new ModuleInstanciation();
+  d.absolute_root_node = d.root_module->evaluate(&root_ctx, d.root_inst);
+  if (!d.absolute_root_node)
+    return false;
+  d.root_node = d.absolute_root_node;
+  d.root_node->dump("");
+  r.msecs["evaluate"].append(bench_lap(timer));
+
+  double m[16];
+  for (int i = 0; i < 16; i++)
+    m[i] = i % 5 == 0 ? 1.0 : 0.0;
+
+  // Subtrees the autorender would hand to CGAL are left as they are, so that
+  // CGAL time is only counted in the cgal stage
+  double autorender_limit = csg_autorender_limit;
+  csg_autorender_limit = 0;
+  d.root_raw_term = d.root_node->render_csg_term(m, &d.highlight_terms, &d.background_terms);
+  csg_autorender_limit = autorender_limit;
+  r.msecs["csg"].append(bench_lap(timer));
+
+  if (d.root_raw_term) {
+    d.root_norm_term = d.root_raw_term->link();
+    normalize_term(d.root_norm_term);
+    d.root_chain = new CSGChain();
+    if (d.root_norm_term)
+      d.root_chain->import(d.root_norm_term);
+  }
+  r.msecs["normalize"].append(bench_lap(timer));
+
+  if (with_cgal) {
+    CGAL_Nef_polyhedron N = d.root_node->render_cgal_nef_polyhedron().N;
+    r.msecs["cgal"].append(bench_lap(timer));
+  }
+
+  int hits, misses;
+  profile_totals(hits, misses);
+  r.cache_hits += hits;
+  r.cache_misses += misses;
+
+  return true;
+}
+
+// On Linux the high-water mark of the resident set can be reset, so the
+// peak is measured per file. Elsewhere it is the peak of the whole process
+// and only grows from file to file.
+static void bench_peak_rss_reset() {
+  QFile f("/proc/self/clear_refs");
+  if (f.open(QIODevice::WriteOnly))
+    f.write("5");
+}
+
+static long bench_peak_rss() {
+  QFile f("/proc/self/status");
+  if (f.open(QIODevice::ReadOnly | QIODevice::Text)) {
+    while (!f.atEnd()) {
+      QString line = f.readLine();
+      if (line.startsWith("VmHWM:"))
+        return line.mid(6).remove("kB").trimmed().toLong();
+    }
+  }
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru) == 0)
+    return ru.ru_maxrss;
+  return 0;
+}
+
+static void bench_file(const QString &filename, int runs, bool with_cgal, BenchResult &r) {
+  r.file = filename;
+
+  QFile f(filename);
+  if (!f.open(QIODevice::ReadOnly)) {
+    fprintf(stderr, "Can't open `%s'.\n", filename.toLocal8Bit().data());
+    return;
+  }
+  QByteArray source = f.readAll();
+
+  // Relative file names (dxf, surface data) are resolved from the cwd
+  QString old_cwd = QDir::currentPath();
+  QDir::setCurrent(QFileInfo(filename).absolutePath());
+
+  bench_peak_rss_reset();
+
+  r.ok = true;
+  for (int i = 0; i < runs && r.ok; i++)
+    r.ok = bench_run(source, with_cgal, r);
+  r.cache_hits /= runs;
+  r.cache_misses /= runs;
+
+  QDir::setCurrent(old_cwd);
+
+  r.peak_rss_kb = bench_peak_rss();
+}
+
+static double bench_median(QVector<double> v) {
+  if (v.isEmpty())
+    return 0;
+  std::sort(v.begin(), v.end());
+  int n = v.size();
+  return n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+static double bench_p95(QVector<double> v) {
+  if (v.isEmpty())
+    return 0;
+  std::sort(v.begin(), v.end());
+  int rank = (int) ceil(0.95 * v.size());
+  return v[qMax(rank, 1) - 1];
+}
+
+static QJsonObject bench_json(const QList<BenchResult> &results, int runs) {
+  QJsonArray files;
+  foreach(const BenchResult &r, results) {
+    QJsonObject o;
+    o["file"] = QFileInfo(r.file).fileName();
+    o["ok"] = r.ok;
+    QJsonObject stages;
+    for (int i = 0; bench_stages[i]; i++) {
+      if (!r.msecs.contains(bench_stages[i]))
+        continue;
+      QJsonObject s;
+      s["median_ms"] = bench_median(r.msecs[bench_stages[i]]);
+      s["p95_ms"] = bench_p95(r.msecs[bench_stages[i]]);
+      stages[bench_stages[i]] = s;
+    }
+    o["stages"] = stages;
+    o["peak_rss_kb"] = (double) r.peak_rss_kb;
+    o["cgal_cache_hits"] = r.cache_hits;
+    o["cgal_cache_misses"] = r.cache_misses;
+    files.append(o);
+  }
+  QJsonObject root;
+  root["runs"] = runs;
+  root["files"] = files;
+  return root;
+}
+
+static void bench_print(const QList<BenchResult> &results) {
+  printf("%-20s %-10s %12s %12s\n", "file", "stage", "median[ms]", "p95[ms]");
+  foreach(const BenchResult &r, results) {
+    QByteArray name = QFileInfo(r.file).fileName().toLocal8Bit();
+    if (!r.ok) {
+      printf("%-20s FAILED\n", name.data());
+      continue;
+    }
+    for (int i = 0; bench_stages[i]; i++) {
+      if (!r.msecs.contains(bench_stages[i]))
+        continue;
+      printf("%-20s %-10s %12.2f %12.2f\n", name.data(), bench_stages[i],
+          bench_median(r.msecs[bench_stages[i]]), bench_p95(r.msecs[bench_stages[i]]));
+    }
+    printf("%-20s peak rss %ld kB, cgal cache %d hits / %d misses per run\n", name.data(),
+        r.peak_rss_kb, r.cache_hits, r.cache_misses);
+  }
+}
+
+// Compares the medians against a previous results file (written with -o on
+// the same machine, there is no stored baseline). Stages that take less
+// than a millisecond are too noisy to be judged.
+static int bench_compare(const QJsonObject &current, const QString &baseline_file, double threshold) {
+  QFile f(baseline_file);
+  if (!f.open(QIODevice::ReadOnly)) {
+    fprintf(stderr, "Can't open baseline `%s'.\n", baseline_file.toLocal8Bit().data());
+    return -1;
+  }
+  QJsonObject baseline = QJsonDocument::fromJson(f.readAll()).object();
+
+  QHash<QString, QJsonObject> base_files;
+  foreach(const QJsonValue &v, baseline["files"].toArray())
+  base_files[v.toObject()["file"].toString()] = v.toObject()["stages"].toObject();
+
+  int regressions = 0;
+  printf("\n%-20s %-10s %12s %12s %8s\n", "file", "stage", "base[ms]", "now[ms]", "ratio");
+  foreach(const QJsonValue &v, current["files"].toArray()) {
+    QString name = v.toObject()["file"].toString();
+    if (!base_files.contains(name))
+      continue;
+    QJsonObject stages = v.toObject()["stages"].toObject();
+    QJsonObject base_stages = base_files[name];
+    for (int i = 0; bench_stages[i]; i++) {
+      if (!stages.contains(bench_stages[i]) || !base_stages.contains(bench_stages[i]))
+        continue;
+      double now = stages[bench_stages[i]].toObject()["median_ms"].toDouble();
+      double base = base_stages[bench_stages[i]].toObject()["median_ms"].toDouble();
+      double ratio = base > 0 ? now / base : 1;
+      bool slower = ratio > 1 + threshold && now - base > 1.0;
+      printf("%-20s %-10s %12.2f %12.2f %7.2fx%s\n", name.toLocal8Bit().data(),
+          bench_stages[i], base, now, ratio, slower ? "  REGRESSION" : "");
+      if (slower)
+        regressions++;
+    }
+  }
+  return regressions;
+}
+
+struct BenchJob {
+  QStringList files;
+  int runs;
+  bool with_cgal;
+  QList<BenchResult> results;
+};
+
+static void bench_job(void *vp) {
+  BenchJob *job = (BenchJob*) vp;
+  foreach(const QString &file, job->files) {
+    BenchResult r;
+    bench_file(file, job->runs, job->with_cgal, r);
+    job->results.append(r);
+  }
+}
+
+static void bench_usage() {
+  fprintf(stderr, "Usage: openscad --benchmark [-n runs] [-o results.json] [-b baseline.json]\n"
+      "                          [-t threshold_percent] [--no-cgal] [file.scad ...]\n");
+}
+
+int benchmark_main(int argc, char **argv) {
+  QCoreApplication app(argc, argv);
+  QStringList files;
+  QString output_file, baseline_file;
+  int runs = 5;
+  double threshold = 0.10;
+  bool with_cgal = true;
+
+  for (int i = 2; i < argc; i++) {
+    QString arg = argv[i];
+    if (arg == "-n" && i + 1 < argc) {
+      runs = qMax(atoi(argv[++i]), 1);
+    } else if (arg == "-o" && i + 1 < argc) {
+      output_file = argv[++i];
+    } else if (arg == "-b" && i + 1 < argc) {
+      baseline_file = argv[++i];
+    } else if (arg == "-t" && i + 1 < argc) {
+      threshold = atof(argv[++i]) / 100;
+    } else if (arg == "--no-cgal") {
+      with_cgal = false;
+    } else if (arg.startsWith("-")) {
+      bench_usage();
+      return 1;
+    } else {
+      files.append(arg);
+    }
+  }
+
+  if (files.isEmpty()) {
+    QDir dir("benchmark");
+    foreach(const QString &name, dir.entryList(QStringList() << "*.scad", QDir::Files, QDir::Name))
+    files.append(dir.filePath(name));
+  }
+  if (files.isEmpty()) {
+    bench_usage();
+    return 1;
+  }
+
+  profile_enabled = true;
+
+  BenchJob t;
+  t.files = files;
+  t.runs = runs;
+  t.with_cgal = with_cgal;
+  headless_run(bench_job, &t);
+
+  profile_enabled = false;
+
+  bench_print(t.results);
+  QJsonObject results = bench_json(t.results, runs);
+
+  if (!output_file.isEmpty()) {
+    QFile f(output_file);
+    if (!f.open(QIODevice::WriteOnly)) {
+      fprintf(stderr, "Can't write `%s'.\n", output_file.toLocal8Bit().data());
+      return 1;
+    }
+    f.write(QJsonDocument(results).toJson());
+  }
+
+  int rc = 0;
+  foreach(const BenchResult &r, t.results) {
+    if (!r.ok)
+      rc = 1;
+  }
+
+  if (!baseline_file.isEmpty()) {
+    int regressions = bench_compare(results, baseline_file, threshold);
+    if (regressions < 0)
+      return 1;
+    if (regressions > 0) {
+      printf("%d stage(s) more than %.0f%% slower than the baseline.\n", regressions, threshold * 100);
+      rc = 1;
+    }
+  }
+
+  return rc;
+}
+
+// Scaling mode: "openscad --scaling" generates families of synthetic designs
+// of growing size, benchmarks them and fits the log-log slope of the time
+// against the size. A slope well above 1 means superlinear growth.
+
+static QString scaling_union_cubes(int n, const QString &) {
+  QString text = "union() {\n";
+  for (int i = 0; i < n; i++)
+    text += QString("  translate([%1, %2, 0]) cube([3, 3, %3]);\n").arg((i % 16) * 2).arg((i / 16) * 2).arg(1 + i % 5);
+  return text + "}\n";
+}
+
+static QString scaling_difference_chain(int n, const QString &) {
+  QString text = "cube([100, 10, 10]);\n";
+  for (int i = 0; i < n; i++) {
+    text = QString("difference() {\n%1translate([%2, 5, -1]) cylinder(r = 2, h = 12, $fn = 12);\n}\n")
+        .arg(text).arg(100.0 * (i + 0.5) / n);
+  }
+  return text;
+}
+
+static QString scaling_nested_transforms(int n, const QString &) {
+  QString text;
+  for (int i = 0; i < n; i++)
+    text += QString("translate([0.1, 0, 0]) rotate([0, 0, %1])\n").arg(360.0 / n);
+  return text + "cube(5, center = true);\n";
+}
+
+static QString scaling_for_loop(int n, const QString &) {
+  return QString("for (i = [0:%1])\n"
+      "  translate([(i % 32) * 2, (i - i % 32) / 16, 0]) cube(1);\n").arg(n - 1);
+}
+
+// The heightmap is n x n, the data file is written next to the design
+static QString scaling_heightmap(int n, const QString &dir) {
+  QFile f(QDir(dir).filePath(QString("heightmap_%1.dat").arg(n)));
+  if (f.open(QIODevice::WriteOnly)) {
+    for (int y = 0; y < n; y++) {
+      QString line;
+      for (int x = 0; x < n; x++)
+        line += QString("%1 ").arg(5 + 3 * sin(x * 6.0 / n) * cos(y * 5.0 / n), 0, 'f', 2);
+      f.write(line.trimmed().toLatin1() + "\n");
+    }
+  }
+  return QString("surface(file = \"heightmap_%1.dat\", center = true);\n").arg(n);
+}
+
+static struct {
+  const char *name;
+  QString (*generate)(int size, const QString &dir);
+  int sizes[6];
+} scaling_families[] = {
+  { "union_cubes", scaling_union_cubes, { 4, 8, 16, 32, 64, 0 } },
+  { "difference_chain", scaling_difference_chain, { 2, 4, 8, 16, 32, 0 } },
+  { "nested_transforms", scaling_nested_transforms, { 8, 32, 128, 512, 0 } },
+  { "for_loop", scaling_for_loop, { 16, 64, 256, 1024, 0 } },
+  { "heightmap", scaling_heightmap, { 8, 16, 32, 64, 0 } },
+  { NULL, NULL, { 0 } }
+};
+
+// Least squares fit of log(y) = slope * log(x) + c. Points below 0.05 ms
+// are mostly timer noise and are left out.
+static bool scaling_slope(const QVector<double> &x, const QVector<double> &y, double &slope) {
+  double sx = 0, sy = 0, sxx = 0, sxy = 0;
+  int n = 0;
+  for (int i = 0; i < x.size(); i++) {
+    if (y[i] < 0.05)
+      continue;
+    double lx = log(x[i]), ly = log(y[i]);
+    sx += lx, sy += ly, sxx += lx * lx, sxy += lx * ly;
+    n++;
+  }
+  if (n < 3 || n * sxx - sx * sx <= 0)
+    return false;
+  slope = (n * sxy - sx * sy) / (n * sxx - sx * sx);
+  return true;
+}
+
+static void scaling_usage() {
+  fprintf(stderr, "Usage: openscad --scaling [-n runs] [-o output_dir] [-s max_slope]\n"
+      "                        [--no-cgal] [family ...]\n");
+}
+
+int scaling_main(int argc, char **argv) {
+  QCoreApplication app(argc, argv);
+  QStringList families;
+  QString output_dir = "scaling";
+  int runs = 3;
+  double max_slope = 1.3;
+  bool with_cgal = true;
+
+  for (int i = 2; i < argc; i++) {
+    QString arg = argv[i];
+    if (arg == "-n" && i + 1 < argc) {
+      runs = qMax(atoi(argv[++i]), 1);
+    } else if (arg == "-o" && i + 1 < argc) {
+      output_dir = argv[++i];
+    } else if (arg == "-s" && i + 1 < argc) {
+      max_slope = atof(argv[++i]);
+    } else if (arg == "--no-cgal") {
+      with_cgal = false;
+    } else if (arg.startsWith("-")) {
+      scaling_usage();
+      return 1;
+    } else {
+      families.append(arg);
+    }
+  }
+
+  if (!QDir().mkpath(output_dir)) {
+    fprintf(stderr, "Can't create `%s'.\n", output_dir.toLocal8Bit().data());
+    return 1;
+  }
+  QDir dir(output_dir);
+
+  BenchJob t;
+  t.runs = runs;
+  t.with_cgal = with_cgal;
+
+  QList<int> family_idx, family_size;
+  for (int i = 0; scaling_families[i].name; i++) {
+    if (!families.isEmpty() && !families.contains(scaling_families[i].name))
+      continue;
+    for (int j = 0; scaling_families[i].sizes[j]; j++) {
+      int size = scaling_families[i].sizes[j];
+      QString filename = dir.filePath(QString("%1_%2.scad").arg(scaling_families[i].name).arg(size));
+      QFile f(filename);
+      if (!f.open(QIODevice::WriteOnly)) {
+        fprintf(stderr, "Can't write `%s'.\n", filename.toLocal8Bit().data());
+        return 1;
+      }
+      f.write(scaling_families[i].generate(size, output_dir).toLatin1());
+      t.files.append(filename);
+      family_idx.append(i);
+      family_size.append(size);
+    }
+  }
+
+  profile_enabled = true;
+  headless_run(bench_job, &t);
+  profile_enabled = false;
+
+  // One CSV file and one plot per family
+  QFile gp(dir.filePath("scaling.gnuplot"));
+  if (!gp.open(QIODevice::WriteOnly | QIODevice::Text)) {
+    fprintf(stderr, "Can't write `%s'.\n", gp.fileName().toLocal8Bit().data());
+    return 1;
+  }
+  gp.write("# Run with \"gnuplot scaling.gnuplot\" in this directory\n"
+      "set terminal png size 1000,500\n"
+      "set datafile separator \",\"\n"
+      "set key left top\n"
+      "set logscale xy\n"
+      "set xlabel \"size\"\n");
+
+  int rc = 0;
+  printf("%-20s %-10s %8s\n", "family", "stage", "slope");
+  for (int i = 0; scaling_families[i].name; i++) {
+    QVector<double> sizes, rss;
+    QHash<QString, QVector<double> > msecs;
+    bool ok = true;
+    for (int k = 0; k < t.results.size(); k++) {
+      if (family_idx[k] != i)
+        continue;
+      const BenchResult &r = t.results[k];
+      ok = ok && r.ok;
+      sizes.append(family_size[k]);
+      rss.append(r.peak_rss_kb);
+      for (int s = 0; bench_stages[s]; s++)
+        msecs[bench_stages[s]].append(bench_median(r.msecs[bench_stages[s]]));
+    }
+    if (sizes.isEmpty())
+      continue;
+    if (!ok) {
+      printf("%-20s FAILED\n", scaling_families[i].name);
+      rc = 1;
+      continue;
+    }
+
+    QString csv_name = QString("%1.csv").arg(scaling_families[i].name);
+    QFile csv(dir.filePath(csv_name));
+    if (csv.open(QIODevice::WriteOnly | QIODevice::Text)) {
+      QString header = "size";
+      for (int s = 0; bench_stages[s]; s++)
+        header += QString(",%1_ms").arg(bench_stages[s]);
+      csv.write((header + ",peak_rss_kb\n").toLatin1());
+      for (int k = 0; k < sizes.size(); k++) {
+        QString line = QString::number(sizes[k]);
+        for (int s = 0; bench_stages[s]; s++)
+          line += QString(",%1").arg(msecs[bench_stages[s]][k], 0, 'f', 3);
+        csv.write((line + QString(",%1\n").arg(rss[k])).toLatin1());
+      }
+    }
+
+    QString plot = QString("\nset output \"%1.png\"\n"
+        "set multiplot layout 1,2 title \"%1\"\n"
+        "set ylabel \"time [ms]\"\n"
+        "plot ").arg(scaling_families[i].name);
+    for (int s = 0; bench_stages[s]; s++) {
+      plot += QString("%1\"%2\" using 1:%3 with linespoints title \"%4\"")
+          .arg(s ? ", " : "").arg(csv_name).arg(s + 2).arg(bench_stages[s]);
+    }
+    int rss_column = 2;
+    while (bench_stages[rss_column - 2])
+      rss_column++;
+    plot += QString("\nset ylabel \"peak rss [kB]\"\n"
+        "plot \"%1\" using 1:%2 with linespoints title \"peak rss\"\n"
+        "unset multiplot\n").arg(csv_name).arg(rss_column);
+    gp.write(plot.toLatin1());
+
+    for (int s = 0; bench_stages[s]; s++) {
+      double slope;
+      if (!scaling_slope(sizes, msecs[bench_stages[s]], slope))
+        continue;
+      bool superlinear = slope > max_slope;
+      printf("%-20s %-10s %8.2f%s\n", scaling_families[i].name, bench_stages[s], slope,
+          superlinear ? "  SUPERLINEAR" : "");
+      if (superlinear)
+        rc = 1;
+    }
+  }
+
+  printf("Results written to `%s'.\n", output_dir.toLocal8Bit().data());
+  return rc;
+}
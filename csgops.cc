@@ -22,6 +22,11 @@
 
 #include "openscad.h"
 
+#include <CGAL/Polygon_mesh_processing/triangulate_faces.h>
+#include <CGAL/Polygon_mesh_processing/self_intersections.h>
+#include <QtConcurrentRun>
+#include <algorithm>
+
 enum csg_type_e {
   CSG_TYPE_UNION,
   CSG_TYPE_DIFFERENCE,
@@ -43,7 +48,8 @@ public:
 
   CsgNode(const ModuleInstanciation *mi, csg_type_e type) : AbstractNode(mi), type(type) {
   }
-  virtual CGAL_Nef_polyhedron render_cgal_nef_polyhedron() const;
+  virtual CGAL_Nef_operand render_cgal_nef_polyhedron() const;
+  virtual bool render_mesh(CGAL_Mesh &M) const;
   CSGTerm *render_csg_term(double m[16], QVector<CSGTerm*> *highlights, QVector<CSGTerm*> *background) const;
   virtual QString dump(QString indent) const;
 };
@@ -60,37 +66,297 @@ AbstractNode *CsgModule::evaluate(const Context*, const ModuleInstanciation *ins
 }
 
 
-CGAL_Nef_polyhedron CsgNode::render_cgal_nef_polyhedron() const {
+BoundingBox cgal_nef_bbox(const CGAL_Nef_polyhedron &N) {
+  BoundingBox bb;
+  CGAL_Nef_polyhedron::Vertex_const_iterator vi;
+  for (vi = N.vertices_begin(); vi != N.vertices_end(); ++vi) {
+    bb.extend(CGAL::to_double(vi->point().x()),
+            CGAL::to_double(vi->point().y()),
+            CGAL::to_double(vi->point().z()));
+  }
+  return bb;
+}
+
+void cgal_nef_make_exact(const CGAL_Nef_polyhedron &N) {
+#ifdef ENABLE_CGAL_LAZY_KERNEL
+  // A lazy value computes its exact value in place the first time it is
+  // needed. Once every point, plane and circle of N has been evaluated, other
+  // threads only read N, so it can be cached and shared between threads.
+  CGAL_Nef_polyhedron::Vertex_const_iterator vi;
+  for (vi = N.vertices_begin(); vi != N.vertices_end(); ++vi)
+    CGAL::exact(vi->point());
+  CGAL_Nef_polyhedron::Halfedge_const_iterator ei;
+  for (ei = N.halfedges_begin(); ei != N.halfedges_end(); ++ei)
+    CGAL::exact(ei->point());
+  CGAL_Nef_polyhedron::Halffacet_const_iterator fi;
+  for (fi = N.halffacets_begin(); fi != N.halffacets_end(); ++fi)
+    CGAL::exact(fi->plane());
+  CGAL_Nef_polyhedron::SHalfedge_const_iterator si;
+  for (si = N.shalfedges_begin(); si != N.shalfedges_end(); ++si)
+    CGAL::exact(si->circle());
+  CGAL_Nef_polyhedron::SHalfloop_const_iterator li;
+  for (li = N.shalfloops_begin(); li != N.shalfloops_end(); ++li)
+    CGAL::exact(li->circle());
+#else
+  (void) N;
+#endif
+}
+
+QAtomicInt cgal_snap_moved;
+
+static CGAL_Kernel::FT snap_coord(const CGAL_Kernel::FT &v, double grid, bool &moved) {
+  double d = round(CGAL::to_double(v) / grid) * grid;
+  if (CGAL_Kernel::FT(d) != v)
+    moved = true;
+  return CGAL_Kernel::FT(d);
+}
+
+bool cgal_nef_snap(CGAL_Nef_operand &r, double grid) {
+  // Every rotation and every intersection point adds digits to the rational
+  // coordinates. Rounding them to a grid (as doubles, so the rationals have
+  // small power-of-two denominators) keeps the later operations cheap. The
+  // surface is triangulated first, so the facets stay planar after rounding.
+  // If the rounded mesh isn't a valid polyhedron, the exact result is kept.
+  const CGAL_Nef_polyhedron &N = r.N;
+  if (N.is_empty() || !N.is_simple())
+    return false;
+
+  CGAL_Polyhedron P;
+  N.convert_to_Polyhedron(P);
+  CGAL::Polygon_mesh_processing::triangulate_faces(P);
+
+  int moved = 0;
+  CGAL_Polyhedron::Vertex_iterator vi;
+  for (vi = P.vertices_begin(); vi != P.vertices_end(); ++vi) {
+    bool m = false;
+    CGAL_Kernel::FT x = snap_coord(vi->point().x(), grid, m);
+    CGAL_Kernel::FT y = snap_coord(vi->point().y(), grid, m);
+    CGAL_Kernel::FT z = snap_coord(vi->point().z(), grid, m);
+    if (m) {
+      vi->point() = CGAL_Point(x, y, z);
+      moved++;
+    }
+  }
+  if (moved == 0)
+    return true;
+
+  if (!P.is_valid() || CGAL::Polygon_mesh_processing::does_self_intersect(P))
+    return false;
+  CGAL_Nef_polyhedron snapped(P);
+  if (!snapped.is_simple())
+    return false;
+
+  r.N = snapped;
+  // No vertex has moved by more than half a grid step
+  for (int i = 0; i < 3 && !r.bb.is_empty(); i++) {
+    r.bb.min[i] -= grid / 2;
+    r.bb.max[i] += grid / 2;
+  }
+  cgal_snap_moved.fetchAndAddOrdered(moved);
+  return true;
+}
+
+static CGAL_Nef_operand cgal_nef_combine(const CGAL_Nef_operand &a, const CGAL_Nef_operand &b, CSGTerm::type_e op) {
+  CGAL_Nef_operand r;
+
+  if (op == CSGTerm::TYPE_INTERSECTION) {
+    // disjoint operands: the result is empty
+    if (!a.bb.intersects(b.bb))
+      return r;
+    r.N = a.N * b.N;
+    r.bb = a.bb.intersection(b.bb);
+    return r;
+  }
+
+  if (op == CSGTerm::TYPE_DIFFERENCE) {
+    // nothing to cut away
+    if (!a.bb.intersects(b.bb))
+      return a;
+    r.N = a.N - b.N;
+    r.bb = a.bb;
+    return r;
+  }
+
+  if (b.bb.is_empty())
+    return a;
+  if (a.bb.is_empty())
+    return b;
+  r.N = a.N + b.N;
+  r.bb = a.bb;
+  r.bb.extend(b.bb);
+  return r;
+}
+
+// The pairs of a level run on the thread pool, and the results are combined
+// on other threads at the next level
+static CGAL_Nef_operand cgal_nef_combine_exact(const CGAL_Nef_operand &a, const CGAL_Nef_operand &b, CSGTerm::type_e op) {
+  CGAL_Nef_operand r = cgal_nef_combine(a, b, op);
+  cgal_nef_make_exact(r.N);
+  return r;
+}
+
+static bool cgal_nef_smaller(const CGAL_Nef_operand &a, const CGAL_Nef_operand &b) {
+  return a.N.number_of_vertices() < b.N.number_of_vertices();
+}
+
+// Orders operands by the center of their bounding boxes along one axis.
+struct CGAL_Nef_locality_less {
+  int axis;
+
+  CGAL_Nef_locality_less(int axis) : axis(axis) {
+  }
+
+  bool operator()(const CGAL_Nef_operand &a, const CGAL_Nef_operand &b) const {
+    if (a.bb.is_empty() || b.bb.is_empty())
+      return !a.bb.is_empty() < !b.bb.is_empty();
+    return a.bb.min[axis] + a.bb.max[axis] < b.bb.min[axis] + b.bb.max[axis];
+  }
+};
+
+CGAL_Nef_operand cgal_nef_reduce(QList<CGAL_Nef_operand> list, CSGTerm::type_e op) {
+  // Folding left to right lets the accumulated result grow with every step, so
+  // each operation pays for all operands before it. Instead the operands are
+  // combined pairwise in a balanced tree. Intersection operands are sorted by
+  // size at each level so operands of similar complexity are paired and the big
+  // ones are kept for the last levels. Union operands are sorted along the
+  // longest axis of their common bounding box so neighbours are merged first.
+  // The pairs of one level are independent and are combined concurrently.
+  if (list.isEmpty())
+    return CGAL_Nef_operand();
+
+  while (list.size() > 1 && !progress_cancelled()) {
+    if (op == CSGTerm::TYPE_UNION) {
+      BoundingBox all;
+      foreach(const CGAL_Nef_operand &v, list)
+      all.extend(v.bb);
+      int axis = 0;
+      for (int i = 1; i < 3 && !all.is_empty(); i++) {
+        if (all.max[i] - all.min[i] > all.max[axis] - all.min[axis])
+          axis = i;
+      }
+      std::stable_sort(list.begin(), list.end(), CGAL_Nef_locality_less(axis));
+    } else {
+      std::stable_sort(list.begin(), list.end(), cgal_nef_smaller);
+    }
+
+    QList<CGAL_Nef_operand> next;
+    if (cgal_render_threads > 1 && list.size() > 3) {
+      QList< QFuture<CGAL_Nef_operand> > futures;
+      for (int i = 0; i + 1 < list.size(); i += 2)
+        futures.append(QtConcurrent::run(cgal_nef_combine_exact, list[i], list[i + 1], op));
+      for (int i = 0; i < futures.size(); i++)
+        next.append(progress_wait(futures[i]));
+    } else {
+      for (int i = 0; i + 1 < list.size(); i += 2)
+        next.append(cgal_nef_combine(list[i], list[i + 1], op));
+    }
+    if (list.size() % 2 == 1)
+      next.append(list.last());
+
+    list = next;
+  }
+
+  return list.first();
+}
+
+CGAL_Nef_operand CsgNode::render_cgal_nef_polyhedron() const {
+  TraceSpan span("render_cgal_nef_polyhedron", this);
   QString cache_id = mk_cache_id();
-  if (cgal_nef_cache.contains(cache_id)) {
+  CGAL_Nef_operand N;
+  if (cgal_nef_cache_lookup(cache_id, N)) {
+    profile_cache_hit(this);
     progress_report();
-    return *cgal_nef_cache[cache_id];
+    return N;
   }
 
-  bool first = true;
-  CGAL_Nef_polyhedron N;
+  // Only the time spent in this node is profiled, not the children
+  QElapsedTimer timer;
+  qint64 nsecs = 0;
+  int vertices_in = 0;
 
-  foreach(AbstractNode *v, children) {
-    if (v->modinst->tag_background)
-      continue;
-    if (first) {
-      N = v->render_cgal_nef_polyhedron();
-      first = false;
-    } else if (type == CSG_TYPE_UNION) {
-      N += v->render_cgal_nef_polyhedron();
-    } else if (type == CSG_TYPE_DIFFERENCE) {
-      N -= v->render_cgal_nef_polyhedron();
-    } else if (type == CSG_TYPE_INTERSECTION) {
-      N *= v->render_cgal_nef_polyhedron();
+  if (type == CSG_TYPE_UNION) {
+    QList<CGAL_Nef_operand> child_N = render_cgal_nef_children();
+    vertices_in = cgal_nef_vertices(child_N);
+    timer.start();
+    N = cgal_nef_reduce(child_N, CSGTerm::TYPE_UNION);
+    nsecs += timer.nsecsElapsed();
+  }
+
+  if (type == CSG_TYPE_INTERSECTION) {
+    // Cheapest operands first, so the intermediate results stay small. The
+    // chain stops as soon as the result is empty and the remaining children
+    // are not rendered at all.
+    QList< QPair<int, const AbstractNode*> > plan;
+    foreach(AbstractNode *v, children) {
+      if (!v->modinst->tag_background)
+        plan.append(QPair<int, const AbstractNode*>(v->cgal_cost_estimate(), v));
     }
+    std::stable_sort(plan.begin(), plan.end());
+
+    CGAL_Nef_operand result;
+    for (int i = 0; i < plan.size() && !progress_cancelled(); i++) {
+      CGAL_Nef_operand v = plan[i].second->render_cgal_nef_polyhedron();
+      vertices_in += v.N.number_of_vertices();
+      timer.start();
+      result = i == 0 ? v : cgal_nef_combine(result, v, CSGTerm::TYPE_INTERSECTION);
+      nsecs += timer.nsecsElapsed();
+      if (result.bb.is_empty() || result.N.is_empty())
+        break;
+    }
+    N = result;
+  }
+
+  if (type == CSG_TYPE_DIFFERENCE) {
+    // All subtrahends are merged into one union (in a balanced tree) and then
+    // subtracted at once. Subtrahends that can't touch the minuend are dropped.
+    QList<CGAL_Nef_operand> child_N = render_cgal_nef_children();
+    vertices_in = cgal_nef_vertices(child_N);
+    timer.start();
+    if (child_N.size() > 0) {
+      CGAL_Nef_operand result = child_N[0];
+      QList<CGAL_Nef_operand> cut;
+      for (int i = 1; i < child_N.size() && !result.bb.is_empty(); i++) {
+        if (result.bb.intersects(child_N[i].bb))
+          cut.append(child_N[i]);
+      }
+      if (cut.size() > 0)
+        result = cgal_nef_combine(result, cgal_nef_reduce(cut, CSGTerm::TYPE_UNION), CSGTerm::TYPE_DIFFERENCE);
+      N = result;
+    }
+    nsecs += timer.nsecsElapsed();
   }
 
-  cgal_nef_cache.insert(cache_id, new CGAL_Nef_polyhedron(N), N.number_of_vertices());
+  if (progress_cancelled())
+    return N;
+  profile_node(this, nsecs, vertices_in, N.N.number_of_vertices());
+
+  cgal_nef_cache_insert(cache_id, N);
   progress_report();
   return N;
 }
 
 
+bool CsgNode::render_mesh(CGAL_Mesh &M) const {
+  TraceSpan span("render_mesh", this);
+  QString cache_id = mk_cache_id();
+  if (cgal_mesh_cache_lookup(cache_id, M)) {
+    progress_report();
+    return true;
+  }
+
+  CSGTerm::type_e op = CSGTerm::TYPE_UNION;
+  if (type == CSG_TYPE_INTERSECTION)
+    op = CSGTerm::TYPE_INTERSECTION;
+  if (type == CSG_TYPE_DIFFERENCE)
+    op = CSGTerm::TYPE_DIFFERENCE;
+  if (!render_mesh_children(M, op))
+    return false;
+
+  cgal_mesh_cache_insert(cache_id, M);
+  progress_report();
+  return true;
+}
+
 CSGTerm *CsgNode::render_csg_term(double m[16], QVector<CSGTerm*> *highlights, QVector<CSGTerm*> *background) const {
   CSGTerm *t1 = NULL;
 
@@ -108,6 +374,7 @@ CSGTerm *CsgNode::render_csg_term(double m[16], QVector<CSGTerm*> *highlights, Q
       }
     }
   }
+  t1 = render_csg_term_autorender(t1, m);
   if (t1 && modinst->tag_highlight && highlights)
     highlights->append(t1->link());
   if (t1 && modinst->tag_background && background) {
@@ -22,6 +22,9 @@
 
 #include "openscad.h"
 
+#include <QSet>
+#include <algorithm>
+
 CSGTerm::CSGTerm(PolySet *polyset, double m[16], QString label) {
   this->type = TYPE_PRIMITIVE;
   this->polyset = polyset;
@@ -31,6 +34,9 @@ CSGTerm::CSGTerm(PolySet *polyset, double m[16], QString label) {
   for (int i = 0; i < 16; i++)
     this->m[i] = m[i];
   refcounter = 1;
+  bbox = polyset->bounding_box().transformed(m);
+  products = neg_products = primitives = 1;
+  convexity = polyset->convexity;
 }
 
 CSGTerm::CSGTerm(type_e type, CSGTerm *left, CSGTerm *right) {
@@ -39,94 +45,274 @@ CSGTerm::CSGTerm(type_e type, CSGTerm *left, CSGTerm *right) {
   this->left = left;
   this->right = right;
   refcounter = 1;
+  primitives = left->primitives + right->primitives;
+  convexity = qMax(left->convexity, right->convexity);
+  if (type == TYPE_UNION) {
+    bbox = left->bbox;
+    bbox.extend(right->bbox);
+    // x - (a + b) -> (x - a) - b
+    products = left->products + right->products;
+    neg_products = left->neg_products * right->neg_products;
+  } else if (type == TYPE_INTERSECTION) {
+    bbox = left->bbox.intersection(right->bbox);
+    // x - (a * b) -> (x - a) + (x - b)
+    products = left->products * right->products;
+    neg_products = left->neg_products + right->neg_products;
+  } else {
+    bbox = left->bbox;
+    // x - (a - b) -> (x - a) + (x * b)
+    products = left->products * right->neg_products;
+    neg_products = left->neg_products + right->products;
+  }
 }
 
-CSGTerm *CSGTerm::normalize() {
-  // This function implements the CSG normalization
-  // Reference: Florian Kirsch, Juergen Doeller,
-  // OpenCSG: A Library for Image-Based CSG Rendering,
-  // University of Potsdam, Hasso-Plattner-Institute, Germany
-  // http://www.opencsg.org/data/csg_freenix2005_paper.pdf
-
-  if (type == TYPE_PRIMITIVE)
-    return link();
-
-  CSGTerm *t1, *t2, *x, *y;
-
-  x = left->normalize();
-  y = right->normalize();
+// Hash-consing of the terms built during one normalization: all requests for
+// the same (type, left, right) triple get the same term, so the products that
+// share a prefix also share its terms.
+struct CSGTermConsKey {
+  CSGTerm::type_e type;
+  CSGTerm *left, *right;
 
-  if (x != left || y != right) {
-    t1 = new CSGTerm(type, x, y);
-  } else {
-    t1 = link();
-    x->unlink();
-    y->unlink();
+  CSGTermConsKey(CSGTerm::type_e type, CSGTerm *left, CSGTerm *right) : type(type), left(left), right(right) {
   }
 
-  while (1) {
-    t2 = t1->normalize_tail();
-    t1->unlink();
-    if (t1 == t2)
-      break;
-    t1 = t2;
+  bool operator==(const CSGTermConsKey &other) const {
+    return type == other.type && left == other.left && right == other.right;
   }
+};
 
-  return t1;
+static uint qHash(const CSGTermConsKey &k) {
+  return ::qHash((quintptr) k.left) ^ (::qHash((quintptr) k.right) * 31) ^ k.type;
 }
 
-CSGTerm *CSGTerm::normalize_tail() {
-  CSGTerm *x, *y, *z;
-
-  // Part A: The 'x . (y . z)' expressions
+class CSGTermCons {
+public:
+  QHash<CSGTermConsKey, CSGTerm*> table;
 
-  x = left;
-  y = right->left;
-  z = right->right;
+  ~CSGTermCons() {
+    foreach(CSGTerm *t, table)
+    t->unlink();
+  }
 
-  // 1.  x - (y + z) -> (x - y) - z
-  if (type == TYPE_DIFFERENCE && right->type == TYPE_UNION)
-    return new CSGTerm(TYPE_DIFFERENCE, new CSGTerm(TYPE_DIFFERENCE, x->link(), y->link()), z->link());
+  // Returns a new reference, the arguments are not consumed
+  CSGTerm *mk(CSGTerm::type_e type, CSGTerm *left, CSGTerm *right) {
+    CSGTermConsKey key(type, left, right);
+    CSGTerm *t = table.value(key);
+    if (!t) {
+      t = new CSGTerm(type, left->link(), right->link());
+      table[key] = t;
+    }
+    return t->link();
+  }
+};
 
-  // 2.  x * (y + z) -> (x * y) + (x * z)
-  if (type == TYPE_INTERSECTION && right->type == TYPE_UNION)
-    return new CSGTerm(TYPE_UNION, new CSGTerm(TYPE_INTERSECTION, x->link(), y->link()), new CSGTerm(TYPE_INTERSECTION, x->link(), z->link()));
+typedef QVector<CSGTerm*> CSGProducts;
 
-  // 3.  x - (y * z) -> (x - y) + (x - z)
-  if (type == TYPE_DIFFERENCE && right->type == TYPE_INTERSECTION)
-    return new CSGTerm(TYPE_UNION, new CSGTerm(TYPE_DIFFERENCE, x->link(), y->link()), new CSGTerm(TYPE_DIFFERENCE, x->link(), z->link()));
+static void csg_products_unlink(CSGProducts &list) {
+  foreach(CSGTerm *t, list)
+  t->unlink();
+  list.clear();
+}
 
-  // 4.  x * (y * z) -> (x * y) * z
-  if (type == TYPE_INTERSECTION && right->type == TYPE_INTERSECTION)
-    return new CSGTerm(TYPE_INTERSECTION, new CSGTerm(TYPE_INTERSECTION, x->link(), y->link()), z->link());
+// Splits a product ((q0 op1 q1) op2 q2) ... into q0 and the terms
+// (q0 op1 q1), ((q0 op1 q1) op2 q2), ... whose type is op_i and whose
+// right side is q_i.
+static CSGTerm *csg_product_split(CSGTerm *q, QVector<CSGTerm*> &steps) {
+  steps.clear();
+  while (q->type != CSGTerm::TYPE_PRIMITIVE) {
+    steps.append(q);
+    q = q->left;
+  }
+  std::reverse(steps.begin(), steps.end());
+  return q;
+}
 
-  // 5.  x - (y - z) -> (x - y) + (x * z)
-  if (type == TYPE_DIFFERENCE && right->type == TYPE_DIFFERENCE)
-    return new CSGTerm(TYPE_UNION, new CSGTerm(TYPE_DIFFERENCE, x->link(), y->link()), new CSGTerm(TYPE_INTERSECTION, x->link(), z->link()));
+// a + b, products that are in both (the same term, thanks to the hash
+// consing) are only kept once.
+static CSGProducts csg_products_union(const CSGProducts &a, const CSGProducts &b) {
+  CSGProducts result;
+  QSet<CSGTerm*> seen;
+  result.reserve(a.size() + b.size());
+  foreach(CSGTerm *p, a + b) {
+    if (seen.contains(p))
+      continue;
+    seen.insert(p);
+    result.append(p->link());
+  }
+  return result;
+}
 
-  // 6.  x * (y - z) -> (x * y) - z
-  if (type == TYPE_INTERSECTION && right->type == TYPE_DIFFERENCE)
-    return new CSGTerm(TYPE_DIFFERENCE, new CSGTerm(TYPE_INTERSECTION, x->link(), y->link()), z->link());
+// x * (q0 op1 q1 ...)  ->  ((x * q0) op1 q1) ...                (rules 4 and 6)
+// (x1 + x2) * (y1 + y2)  ->  x1 * y1 + x2 * y1 + ...             (rules 2 and 9)
+//
+// Products whose bounding box becomes empty are dropped, and subtracted
+// primitives that don't touch the box of the product so far are left out.
+static CSGProducts csg_products_intersection(CSGTermCons &cons, const CSGProducts &a, const CSGProducts &b) {
+  CSGProducts result;
+  QVector<CSGTerm*> steps;
+  foreach(CSGTerm *q, b) {
+    CSGTerm *q0 = csg_product_split(q, steps);
+    foreach(CSGTerm *p, a) {
+      if (!p->bbox.intersects(q->bbox))
+        continue;
+      CSGTerm *t = cons.mk(CSGTerm::TYPE_INTERSECTION, p, q0);
+      foreach(CSGTerm *s, steps) {
+        if (t->bbox.is_empty())
+          break;
+        if (s->type == CSGTerm::TYPE_DIFFERENCE && !t->bbox.intersects(s->right->bbox))
+          continue;
+        CSGTerm *n = cons.mk(s->type, t, s->right);
+        t->unlink();
+        t = n;
+      }
+      if (t->bbox.is_empty())
+        t->unlink();
+      else
+        result.append(t);
+    }
+  }
+  CSGProducts unique = csg_products_union(result, CSGProducts());
+  csg_products_unlink(result);
+  return unique;
+}
 
-  // Part B: The '(x . y) . z' expressions
+// x - (q0 * q1 - q2 ...)  ->  (x - q0) + (x - q1) + (x * q2) ... (rules 3 and 5)
+// x - (y1 + y2)  ->  (x - y1) - y2                               (rule 1)
+// (x1 + x2) - y  ->  (x1 - y) + (x2 - y)                         (rule 8)
+//
+// A subtrahend outside the bounding box of x leaves x unchanged. So does a
+// rule 3 term (x - q_i) with q_i outside the box: it contains all the other
+// terms. Rule 5 terms (x * q_i) with an empty box are dropped.
+static CSGProducts csg_products_difference(CSGTermCons &cons, const CSGProducts &a, const CSGProducts &b) {
+  CSGProducts result = csg_products_union(a, CSGProducts());
+  QVector<CSGTerm*> steps;
+  foreach(CSGTerm *q, b) {
+    CSGTerm *q0 = csg_product_split(q, steps);
+    CSGProducts next;
+    foreach(CSGTerm *p, result) {
+      bool unchanged = !p->bbox.intersects(q->bbox);
+      foreach(CSGTerm *s, steps) {
+        if (s->type == CSGTerm::TYPE_INTERSECTION && !p->bbox.intersects(s->right->bbox))
+          unchanged = true;
+      }
+      if (unchanged) {
+        next.append(p->link());
+        continue;
+      }
+      next.append(cons.mk(CSGTerm::TYPE_DIFFERENCE, p, q0));
+      foreach(CSGTerm *s, steps) {
+        if (s->type == CSGTerm::TYPE_INTERSECTION) {
+          next.append(cons.mk(CSGTerm::TYPE_DIFFERENCE, p, s->right));
+        } else {
+          CSGTerm *t = cons.mk(CSGTerm::TYPE_INTERSECTION, p, s->right);
+          if (t->bbox.is_empty())
+            t->unlink();
+          else
+            next.append(t);
+        }
+      }
+    }
+    csg_products_unlink(result);
+    result = csg_products_union(next, CSGProducts());
+    csg_products_unlink(next);
+  }
+  return result;
+}
 
-  x = left->left;
-  y = left->right;
-  z = right;
+CSGTerm *CSGTerm::normalize() {
+  // This function implements the CSG normalization
+  // Reference: Florian Kirsch, Juergen Doeller,
+  // OpenCSG: A Library for Image-Based CSG Rendering,
+  // University of Potsdam, Hasso-Plattner-Institute, Germany
+  // http://www.opencsg.org/data/csg_freenix2005_paper.pdf
+  //
+  // Instead of applying the rewrite rules until nothing changes, the normal
+  // form (a sum of left-deep products) of every term is built directly from
+  // the normal forms of its two sides, in a single bottom-up pass. Terms
+  // shared between several parents are normalized only once, and the walk
+  // uses an explicit stack so deep trees can't overflow the C++ stack.
+  //
+  // Products that are provably empty according to the bounding boxes are
+  // pruned on the way, so the result is NULL if nothing is left at all.
 
-  // 7. (x - y) * z  -> (x * z) - y
-  if (left->type == TYPE_DIFFERENCE && type == TYPE_INTERSECTION)
-    return new CSGTerm(TYPE_DIFFERENCE, new CSGTerm(TYPE_INTERSECTION, x->link(), z->link()), y->link());
+  if (type == TYPE_PRIMITIVE)
+    return bbox.is_empty() ? NULL : link();
+
+  // Count the references within the DAG so the normal forms of inner terms
+  // can be dropped as soon as the last parent has used them.
+  QHash<CSGTerm*, int> parents;
+  QVector<CSGTerm*> stack;
+  stack.append(this);
+  parents[this] = 0;
+  while (!stack.isEmpty()) {
+    CSGTerm *t = stack.takeLast();
+    if (t->type == TYPE_PRIMITIVE)
+      continue;
+    CSGTerm *sides[2] = { t->left, t->right };
+    for (int i = 0; i < 2; i++) {
+      if (!parents.contains(sides[i]))
+        stack.append(sides[i]);
+      parents[sides[i]]++;
+    }
+  }
 
-  // 8. (x + y) - z  -> (x - z) + (y - z)
-  if (left->type == TYPE_UNION && type == TYPE_DIFFERENCE)
-    return new CSGTerm(TYPE_UNION, new CSGTerm(TYPE_DIFFERENCE, x->link(), z->link()), new CSGTerm(TYPE_DIFFERENCE, y->link(), z->link()));
+  CSGTermCons cons;
+  QHash<CSGTerm*, CSGProducts> memo;
+  stack.append(this);
+  while (!stack.isEmpty()) {
+    CSGTerm *t = stack.last();
+    if (memo.contains(t)) {
+      stack.pop_back();
+      continue;
+    }
+    if (t->type == TYPE_PRIMITIVE) {
+      CSGProducts &products = memo[t];
+      if (!t->bbox.is_empty())
+        products.append(t->link());
+      stack.pop_back();
+      continue;
+    }
+    if (!memo.contains(t->left) || !memo.contains(t->right)) {
+      if (!memo.contains(t->right))
+        stack.append(t->right);
+      if (!memo.contains(t->left))
+        stack.append(t->left);
+      continue;
+    }
+    stack.pop_back();
+
+    const CSGProducts &a = memo[t->left];
+    const CSGProducts &b = memo[t->right];
+    CSGProducts products;
+    if (t->type == TYPE_UNION)
+      products = csg_products_union(a, b);
+    else if (t->type == TYPE_INTERSECTION)
+      products = csg_products_intersection(cons, a, b);
+    else
+      products = csg_products_difference(cons, a, b);
+
+    CSGTerm *sides[2] = { t->left, t->right };
+    for (int i = 0; i < 2; i++) {
+      if (--parents[sides[i]] == 0) {
+        csg_products_unlink(memo[sides[i]]);
+        memo.remove(sides[i]);
+      }
+    }
+    memo[t] = products;
+  }
 
-  // 9. (x + y) * z  -> (x * z) + (y * z)
-  if (left->type == TYPE_UNION && type == TYPE_INTERSECTION)
-    return new CSGTerm(TYPE_UNION, new CSGTerm(TYPE_INTERSECTION, x->link(), z->link()), new CSGTerm(TYPE_INTERSECTION, y->link(), z->link()));
+  // The products are summed up in a left-deep chain of unions
+  CSGProducts &products = memo[this];
+  if (products.isEmpty())
+    return NULL;
+  CSGTerm *result = products[0]->link();
+  for (int i = 1; i < products.size(); i++) {
+    CSGTerm *n = new CSGTerm(TYPE_UNION, result, products[i]->link());
+    result = n;
+  }
+  csg_products_unlink(products);
 
-  return link();
+  return result;
 }
 
 CSGTerm *CSGTerm::link() {
@@ -135,14 +321,20 @@ CSGTerm *CSGTerm::link() {
 }
 
 void CSGTerm::unlink() {
-  if (--refcounter <= 0) {
-    if (polyset)
-      polyset->unlink();
-    if (left)
-      left->unlink();
-    if (right)
-      right->unlink();
-    delete this;
+  if (--refcounter > 0)
+    return;
+  // Normalized products are long left-deep chains, so this avoids recursion
+  QVector<CSGTerm*> dead;
+  dead.append(this);
+  while (!dead.isEmpty()) {
+    CSGTerm *t = dead.takeLast();
+    if (t->polyset)
+      t->polyset->unlink();
+    if (t->left && --t->left->refcounter <= 0)
+      dead.append(t->left);
+    if (t->right && --t->right->refcounter <= 0)
+      dead.append(t->right);
+    delete t;
   }
 }
 
@@ -157,6 +349,12 @@ QString CSGTerm::dump() {
 }
 
 CSGChain::CSGChain() {
+  gl_prepared = false;
+}
+
+CSGChain::~CSGChain() {
+  for (int i = 0; i < gl_merged.size(); i++)
+    delete gl_merged[i].second;
 }
 
 void CSGChain::add(PolySet *polyset, double *m, CSGTerm::type_e type, QString label) {
@@ -167,14 +365,30 @@ void CSGChain::add(PolySet *polyset, double *m, CSGTerm::type_e type, QString la
 }
 
 void CSGChain::import(CSGTerm *term, CSGTerm::type_e type) {
-  if (term->type == CSGTerm::TYPE_PRIMITIVE) {
-    add(term->polyset, term->m, type, term->label);
-  } else {
-    import(term->left, type);
-    import(term->right, term->type);
+  QVector< QPair<CSGTerm*, CSGTerm::type_e> > stack;
+  stack.append(qMakePair(term, type));
+  while (!stack.isEmpty()) {
+    QPair<CSGTerm*, CSGTerm::type_e> e = stack.takeLast();
+    if (e.first->type == CSGTerm::TYPE_PRIMITIVE) {
+      add(e.first->polyset, e.first->m, e.second, e.first->label);
+    } else {
+      stack.append(qMakePair(e.first->right, e.first->type));
+      stack.append(qMakePair(e.first->left, e.second));
+    }
   }
 }
 
+// Color of an entry in the thrown together view (and the rasterizer)
+PolySet::colormode_e CSGChain::colormode(int i, bool highlight, bool background) const {
+  if (highlight)
+    return PolySet::COLORMODE_HIGHLIGHT;
+  if (background)
+    return PolySet::COLORMODE_BACKGROUND;
+  if (types[i] == CSGTerm::TYPE_DIFFERENCE)
+    return PolySet::COLORMODE_CUTOUT;
+  return PolySet::COLORMODE_MATERIAL;
+}
+
 QString CSGChain::dump() {
   QString text;
   for (int i = 0; i < types.size(); i++) {
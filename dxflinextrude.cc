@@ -154,8 +154,11 @@ static void add_slice(PolySet *ps, DxfData::Path *pt, double rot1, double rot2,
 
 PolySet *DxfLinearExtrudeNode::render_polyset(render_mode_e) const {
   QString key = mk_cache_id();
-  if (PolySet::ps_cache.contains(key))
-    return PolySet::ps_cache[key]->ps->link();
+  {
+    QMutexLocker locker(&PolySet::ps_cache_mutex);
+    if (PolySet::ps_cache.contains(key))
+      return PolySet::ps_cache[key]->ps->link();
+  }
 
   DxfData dxf(fn, fs, fa, filename, layername, origin_x, origin_y, scale);
 
@@ -213,7 +216,10 @@ PolySet *DxfLinearExtrudeNode::render_polyset(render_mode_e) const {
     }
   }
 
-  PolySet::ps_cache.insert(key, new PolySetPtr(ps->link()));
+  {
+    QMutexLocker locker(&PolySet::ps_cache_mutex);
+    PolySet::ps_cache.insert(key, new PolySetPtr(ps->link()));
+  }
   return ps;
 }
 
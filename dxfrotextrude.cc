@@ -91,8 +91,11 @@ void register_builtin_dxf_rotate_extrude() {
 PolySet *DxfRotateExtrudeNode::render_polyset(render_mode_e) const {
   QString key = mk_cache_id();
 
-  if (PolySet::ps_cache.contains(key))
-    return PolySet::ps_cache[key]->ps->link();
+  {
+    QMutexLocker locker(&PolySet::ps_cache_mutex);
+    if (PolySet::ps_cache.contains(key))
+      return PolySet::ps_cache[key]->ps->link();
+  }
 
   DxfData dxf(fn, fs, fa, filename, layername, origin_x, origin_y, scale);
 
@@ -153,7 +156,10 @@ PolySet *DxfRotateExtrudeNode::render_polyset(render_mode_e) const {
     }
   }
 
-  PolySet::ps_cache.insert(key, new PolySetPtr(ps->link()));
+  {
+    QMutexLocker locker(&PolySet::ps_cache_mutex);
+    PolySet::ps_cache.insert(key, new PolySetPtr(ps->link()));
+  }
   return ps;
 }
 
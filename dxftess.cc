@@ -160,6 +160,11 @@ static bool point_on_line(double *p1, double *p2, double *p3) {
 }
 
 void dxf_tesselate(PolySet *ps, DxfData *dxf, double rot, bool up, double h) {
+  // The GLU callbacks above collect their results in static variables, so
+  // concurrent CGAL renders must take turns here.
+  static QMutex tess_mutex;
+  QMutexLocker locker(&tess_mutex);
+
   GLUtesselator *tobj = gluNewTess();
 
   gluTessCallback(tobj, GLU_TESS_VERTEX, (GLvoid(*)()) & tess_vertex);
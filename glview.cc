@@ -18,6 +18,8 @@
  *
  */
 
+#define INCLUDE_ABSTRACT_NODE_DETAILS
+
 #include "openscad.h"
 
 #include <QWheelEvent>
@@ -46,6 +48,13 @@ GLView::GLView(QWidget *parent) : QGLWidget(parent) {
 extern GLint e1, e2, e3;
 
 void GLView::initializeGL() {
+  // Buffer objects are core since OpenGL 1.5, Mesa's software rasterizers
+  // have them too. Without them the polysets are drawn from client arrays.
+  GLenum err = glewInit();
+  GLBatch::have_buffers = err == GLEW_OK && GLEW_VERSION_1_5;
+  if (err != GLEW_OK)
+    fprintf(stderr, "GLEW Error: %s\n", glewGetErrorString(err));
+
   glEnable(GL_DEPTH_TEST);
   glDepthRange(-FAR_FAR_AWAY, +FAR_FAR_AWAY);
 
@@ -62,6 +71,8 @@ void GLView::resizeGL(int w, int h) {
 }
 
 void GLView::paintGL() {
+  GLBatch::collect_garbage();
+
   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
 
   glMatrixMode(GL_PROJECTION);
@@ -93,6 +104,16 @@ void GLView::paintGL() {
 
   glDepthFunc(GL_LESS);
 
+  double projection[16], modelview[16];
+  glGetDoublev(GL_PROJECTION_MATRIX, projection);
+  glGetDoublev(GL_MODELVIEW_MATRIX, modelview);
+  for (int i = 0; i < 4; i++)
+    for (int j = 0; j < 4; j++) {
+      view_clip[i*4 + j] = 0;
+      for (int k = 0; k < 4; k++)
+        view_clip[i*4 + j] += projection[k*4 + j] * modelview[i*4 + k];
+    }
+
 #if 0
   glLineWidth(1);
   glColor3d(0.0, 0.0, 1.0);
@@ -113,6 +134,56 @@ void GLView::paintGL() {
     renderfunc(renderfunc_vp);
 }
 
+// Returns 0 if the box (moved by m) is outside the view frustum, and its
+// approximate size on the screen in pixels otherwise. Boxes reaching behind
+// the viewer are treated as infinitely large.
+double GLView::screen_size(const BoundingBox &bb, const double *m) const {
+  if (bb.is_empty())
+    return 0;
+  double c[16];
+  for (int i = 0; i < 4; i++)
+    for (int j = 0; j < 4; j++) {
+      c[i*4 + j] = 0;
+      for (int k = 0; k < 4; k++)
+        c[i*4 + j] += view_clip[k*4 + j] * (m ? m[i*4 + k] : i == k);
+    }
+
+  int outside_all = 63;
+  bool behind = false;
+  double min_x = +HUGE_VAL, max_x = -HUGE_VAL;
+  double min_y = +HUGE_VAL, max_y = -HUGE_VAL;
+  for (int i = 0; i < 8; i++) {
+    double p[3] = {
+      (i & 1) ? bb.max[0] : bb.min[0],
+      (i & 2) ? bb.max[1] : bb.min[1],
+      (i & 4) ? bb.max[2] : bb.min[2]
+    };
+    double v[4];
+    for (int j = 0; j < 4; j++)
+      v[j] = c[j] * p[0] + c[4 + j] * p[1] + c[8 + j] * p[2] + c[12 + j];
+    int outside = 0;
+    for (int j = 0; j < 3; j++) {
+      if (v[j] < -v[3])
+        outside |= 1 << (2*j);
+      if (v[j] > v[3])
+        outside |= 2 << (2*j);
+    }
+    outside_all &= outside;
+    if (v[3] <= 0) {
+      behind = true;
+      continue;
+    }
+    min_x = fmin(min_x, v[0] / v[3]), max_x = fmax(max_x, v[0] / v[3]);
+    min_y = fmin(min_y, v[1] / v[3]), max_y = fmax(max_y, v[1] / v[3]);
+  }
+  if (outside_all)
+    return 0;
+  if (behind)
+    return HUGE_VAL;
+  // Anything visible covers at least one pixel
+  return fmax(1, fmax((max_x - min_x) * width(), (max_y - min_y) * height()) / 2);
+}
+
 void GLView::wheelEvent(QWheelEvent *event) {
   viewer_distance *= pow(0.9, event->delta() / 120.0);
   updateGL();
@@ -140,5 +211,7 @@ void GLView::mouseMoveEvent(QMouseEvent *event) {
 void GLView::mouseReleaseEvent(QMouseEvent*) {
   mouse_drag_active = false;
   releaseMouse();
+  // Back to full detail
+  updateGL();
 }
 
@@ -0,0 +1,102 @@
+/*
+ *  OpenSCAD (www.openscad.at)
+ *  Copyright (C) 2009  Clifford Wolf <clifford@clifford.at>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "openscad.h"
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+
+// Helpers shared by the modes that run without a window (--benchmark,
+// --scaling, --raytrace, --rasterize).
+
+class HeadlessThread : public QThread {
+public:
+  void (*f)(void *vp);
+  void *vp;
+
+  void run() {
+    f(vp);
+  }
+};
+
+// The pipeline runs off the main thread, like the background compile, so
+// render() nodes don't try to open their progress dialog.
+void headless_run(void (*f)(void *vp), void *vp) {
+  HeadlessThread t;
+  t.f = f;
+  t.vp = vp;
+  t.start();
+  t.wait();
+}
+
+// Compiles a file with its own directory as the current directory, so that
+// relative paths of imports resolve as in the GUI. Returns NULL if the file
+// can't be read.
+CompiledDesign *compile_file(const QString &filename) {
+  QFile f(filename);
+  if (!f.open(QIODevice::ReadOnly)) {
+    fprintf(stderr, "Can't open `%s'.\n", filename.toLocal8Bit().data());
+    return NULL;
+  }
+  QByteArray source = f.readAll();
+  QString old_dir = QDir::currentPath();
+  QDir::setCurrent(QFileInfo(filename).absolutePath());
+  CompiledDesign *d = compile_design(source, 0.0, false);
+  QDir::setCurrent(old_dir);
+  return d;
+}
+
+HeadlessImageArgs::HeadlessImageArgs(int size) {
+  width = size;
+  height = size;
+}
+
+bool HeadlessImageArgs::parse(int argc, char **argv, int &i) {
+  QString arg = argv[i];
+  if (arg == "-o" && i + 1 < argc) {
+    output_file = argv[++i];
+  } else if (arg == "-d" && i + 1 < argc) {
+    output_dir = argv[++i];
+  } else if (arg == "-s" && i + 1 < argc) {
+    if (sscanf(argv[++i], "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0)
+      return false;
+  } else if (arg.startsWith("-")) {
+    return false;
+  } else {
+    files.append(arg);
+  }
+  return true;
+}
+
+// A single output file only works for a single image
+bool HeadlessImageArgs::valid(int images_per_file) const {
+  if (files.isEmpty())
+    return false;
+  return output_file.isEmpty() || (files.size() == 1 && images_per_file == 1);
+}
+
+QString HeadlessImageArgs::output(const QString &file, const QString &suffix) const {
+  if (!output_file.isEmpty())
+    return output_file;
+  QFileInfo info(file);
+  QDir dir(output_dir.isEmpty() ? info.absolutePath() : output_dir);
+  return dir.filePath(info.completeBaseName() + suffix + ".png");
+}
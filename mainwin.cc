@@ -32,31 +32,32 @@
 #include <QHBoxLayout>
 #include <QVBoxLayout>
 #include <QLabel>
+#include <QMap>
+#include <QtConcurrentRun>
+
+#ifdef ENABLE_OPENCSG
+#include <opencsg.h>
+#endif
 
 //for chdir
 #include <unistd.h>
 
 QPointer<MainWindow> current_win;
 
-MainWindow::MainWindow(const char *filename) {
-  root_ctx.functions_p = &builtin_functions;
-  root_ctx.modules_p = &builtin_modules;
-  root_ctx.set_variable("$fn", Value(0.0));
-  root_ctx.set_variable("$fs", Value(1.0));
-  root_ctx.set_variable("$fa", Value(12.0));
-  root_ctx.set_variable("$t", Value(0.0));
+static void cgal_gl_forget(MainWindow *m);
 
-  root_module = NULL;
-  absolute_root_node = NULL;
-  root_raw_term = NULL;
-  root_norm_term = NULL;
-  root_chain = NULL;
-  root_N = NULL;
+void init_root_ctx(Context *ctx, double tval) {
+  ctx->functions_p = &builtin_functions;
+  ctx->modules_p = &builtin_modules;
+  ctx->set_variable("$fn", Value(0.0));
+  ctx->set_variable("$fs", Value(1.0));
+  ctx->set_variable("$fa", Value(12.0));
+  ctx->set_variable("$t", Value(tval));
+}
 
-  highlights_chain = NULL;
-  background_chain = NULL;
-  root_node = NULL;
-  enableOpenCSG = false;
+MainWindow::MainWindow(const char *filename) {
+  init_root_ctx(&root_ctx, 0.0);
+  root_N = NULL;
 
   tval = 0;
   fps = 0;
@@ -82,9 +83,20 @@ MainWindow::MainWindow(const char *filename) {
   animate_timer = new QTimer(this);
   connect(animate_timer, SIGNAL(timeout()), this, SLOT(updateTVal()));
 
+  compile_job = NULL;
+  compile_running = false;
+  compile_pending = false;
+  compile_blocked = 0;
+  compile_watcher = new QFutureWatcher<CompiledDesign*>(this);
+  connect(compile_watcher, SIGNAL(finished()), this, SLOT(compileFinished()));
+  compile_timer = new QTimer(this);
+  compile_timer->setSingleShot(true);
+  connect(compile_timer, SIGNAL(timeout()), this, SLOT(actionCompile()));
+  connect(editor, SIGNAL(textChanged()), this, SLOT(compileDebounced()));
+
   l2->addWidget(new QLabel("Time:", w2));
   l2->addWidget(e_tval = new QLineEdit("0", w2));
-  connect(e_tval, SIGNAL(textChanged(QString)), this, SLOT(actionCompile()));
+  connect(e_tval, SIGNAL(textChanged(QString)), this, SLOT(updatedTVal()));
 
   l2->addWidget(new QLabel("FPS:", w2));
   l2->addWidget(e_fps = new QLineEdit("0", w2));
@@ -135,6 +147,14 @@ MainWindow::MainWindow(const char *filename) {
     menu->addAction("Display CSG &Products...", this, SLOT(actionDisplayCSGProducts()));
     menu->addAction("Export as &STL...", this, SLOT(actionExportSTL()));
     menu->addAction("Export as &OFF...", this, SLOT(actionExportOFF()));
+    menu->addAction("Export Ray Traced &Image...", this, SLOT(actionExportImage()));
+    menu->addSeparator();
+    actDesignProfile = menu->addAction("Profile CGAL Rendering", this, SLOT(actionProfile()));
+    actDesignProfile->setCheckable(true);
+    menu->addAction("Export Render &Profile...", this, SLOT(actionExportProfile()));
+    actDesignTrace = menu->addAction("Trace Compile and Render", this, SLOT(actionTrace()));
+    actDesignTrace->setCheckable(true);
+    menu->addAction("Export &Trace...", this, SLOT(actionExportTrace()));
   }
 
   {
@@ -143,6 +163,10 @@ MainWindow::MainWindow(const char *filename) {
     actViewModeCGALGrid = menu->addAction("CGAL Grid Only", this, SLOT(viewModeCGALGrid()));
     actViewModeCGALSurface->setCheckable(true);
     actViewModeCGALGrid->setCheckable(true);
+#ifdef ENABLE_OPENCSG
+    actViewModeOpenCSG = menu->addAction("OpenCSG", this, SLOT(viewModeOpenCSG()));
+    actViewModeOpenCSG->setCheckable(true);
+#endif
     actViewModeThrownTogether = menu->addAction("Thrown Together", this, SLOT(viewModeThrownTogether()));
     actViewModeThrownTogether->setCheckable(true);
 
@@ -188,17 +212,19 @@ MainWindow::MainWindow(const char *filename) {
     setWindowTitle("New Document");
   }
 
+#ifdef ENABLE_OPENCSG
+  viewModeOpenCSG();
+#else
   viewModeThrownTogether();
+#endif
 
   setCentralWidget(s1);
   current_win = NULL;
 }
 
 MainWindow::~MainWindow() {
-  if (root_module)
-    delete root_module;
-  if (root_node)
-    delete root_node;
+  compile_abort();
+  cgal_gl_forget(this);
   if (root_N)
     delete root_N;
 }
@@ -222,6 +248,17 @@ void MainWindow::updateTVal() {
   e_tval->setText(txt);
 }
 
+// A new time value doesn't cancel the running compile, otherwise designs that
+// take longer than one animation step to compile would never show a frame.
+// Only the latest value is compiled once the running compile has finished.
+void MainWindow::updatedTVal() {
+  current_win = this;
+  console->clear();
+
+  compile_timer->stop();
+  compileAsync(false);
+}
+
 void MainWindow::load() {
   if (!filename.isEmpty()) {
     QString text;
@@ -257,178 +294,280 @@ void MainWindow::maybe_change_dir() {
   filename = filename.mid(dir_end_index + 1);
 }
 
-void MainWindow::find_root_tag(AbstractNode *n) {
-
-  foreach(AbstractNode *v, n->children) {
-    if (v->modinst->tag_root)
-      root_node = v;
-    if (root_node)
-      return;
-    find_root_tag(v);
-  }
+CompiledDesign::CompiledDesign() {
+  root_module = NULL;
+  root_inst = NULL;
+  absolute_root_node = NULL;
+  root_raw_term = NULL;
+  root_norm_term = NULL;
+  root_chain = NULL;
+  highlights_chain = NULL;
+  background_chain = NULL;
+  root_node = NULL;
+  enableOpenCSG = false;
 }
 
-void MainWindow::compile(bool procevents) {
-  PRINT("Parsing design (AST generation)...");
-  if (procevents)
-    QApplication::processEvents();
-
-  if (root_module) {
+CompiledDesign::~CompiledDesign() {
+  if (root_module)
     delete root_module;
-    root_module = NULL;
-  }
-
-  if (absolute_root_node) {
+  if (absolute_root_node)
     delete absolute_root_node;
-    absolute_root_node = NULL;
-  }
-
-  if (root_raw_term) {
+  if (root_inst)
+    delete root_inst;
+  if (root_raw_term)
     root_raw_term->unlink();
-    root_raw_term = NULL;
-  }
-
-  if (root_norm_term) {
+  if (root_norm_term)
     root_norm_term->unlink();
-    root_norm_term = NULL;
-  }
-
-  if (root_chain) {
+  if (root_chain)
     delete root_chain;
-    root_chain = NULL;
-  }
-
   foreach(CSGTerm *v, highlight_terms) {
-    v->unlink();
+    if (v)
+      v->unlink();
   }
-  highlight_terms.clear();
-  if (highlights_chain) {
+  if (highlights_chain)
     delete highlights_chain;
-    highlights_chain = NULL;
-  }
-
   foreach(CSGTerm *v, background_terms) {
-    v->unlink();
+    if (v)
+      v->unlink();
   }
-  background_terms.clear();
-  if (background_chain) {
+  if (background_chain)
     delete background_chain;
-    background_chain = NULL;
+}
+
+void CompiledDesign::swap(CompiledDesign &other) {
+  qSwap(root_module, other.root_module);
+  qSwap(root_inst, other.root_inst);
+  qSwap(absolute_root_node, other.absolute_root_node);
+  qSwap(root_raw_term, other.root_raw_term);
+  qSwap(root_norm_term, other.root_norm_term);
+  qSwap(root_chain, other.root_chain);
+  qSwap(highlight_terms, other.highlight_terms);
+  qSwap(highlights_chain, other.highlights_chain);
+  qSwap(background_terms, other.background_terms);
+  qSwap(background_chain, other.background_chain);
+  qSwap(root_node, other.root_node);
+  qSwap(enableOpenCSG, other.enableOpenCSG);
+}
+
+static AbstractNode *find_root_tag(AbstractNode *n) {
+  foreach(AbstractNode *v, n->children) {
+    if (v->modinst->tag_root)
+      return v;
+    AbstractNode *r = find_root_tag(v);
+    if (r)
+      return r;
   }
-  root_node = NULL;
-  enableOpenCSG = false;
+  return NULL;
+}
 
-  root_ctx.set_variable("$t", Value(e_tval->text().toDouble()));
-  root_module = parse(editor->toPlainText().toLatin1().data(), false);
+static void compile_procevents(bool procevents) {
+  if (procevents && progress_in_gui_thread())
+    QApplication::processEvents();
+}
 
-  if (!root_module)
+void normalize_term(CSGTerm *&term) {
+  TraceSpan span("normalize");
+  CSGTerm *n = term->normalize();
+  term->unlink();
+  term = n;
+}
+
+// Builds a complete new CompiledDesign from the source code. This runs on the
+// compile worker thread, so it must not touch the MainWindow. Background
+// compiles that are superseded by a newer one are stopped by cancelling their
+// job, see compileAsync().
+// The headless modes call it as well, on a thread of their own.
+CompiledDesign *compile_design(QByteArray source, double tval, bool procevents) {
+  TraceSpan span("compile");
+  CompiledDesign *d = new CompiledDesign();
+  Context root_ctx;
+  init_root_ctx(&root_ctx, tval);
+
+  PRINT("Parsing design (AST generation)...");
+  compile_procevents(procevents);
+
+  {
+    TraceSpan span("parse");
+    d->root_module = parse(source.data(), false);
+  }
+
+  if (!d->root_module || progress_cancelled())
     goto fail;
 
   PRINT("Compiling design (CSG Tree generation)...");
-  if (procevents)
-    QApplication::processEvents();
+  compile_procevents(procevents);
 
   AbstractNode::idx_counter = 1;
   {
-    ModuleInstanciation root_inst;
-    absolute_root_node = root_module->evaluate(&root_ctx, &root_inst);
+    TraceSpan span("evaluate");
+    d->root_inst = new ModuleInstanciation();
+    d->absolute_root_node = d->root_module->evaluate(&root_ctx, d->root_inst);
   }
 
-  if (!absolute_root_node)
+  if (!d->absolute_root_node || progress_cancelled())
     goto fail;
 
-  find_root_tag(absolute_root_node);
-  if (!root_node)
-    root_node = absolute_root_node;
-  root_node->dump("");
+  d->root_node = find_root_tag(d->absolute_root_node);
+  if (!d->root_node)
+    d->root_node = d->absolute_root_node;
+  d->root_node->dump("");
 
   PRINT("Compiling design (CSG Products generation)...");
-  if (procevents)
-    QApplication::processEvents();
+  compile_procevents(procevents);
 
   double m[16];
 
   for (int i = 0; i < 16; i++)
     m[i] = i % 5 == 0 ? 1.0 : 0.0;
 
-  root_raw_term = root_node->render_csg_term(m, &highlight_terms, &background_terms);
+  {
+    TraceSpan span("render_csg_term");
+    d->root_raw_term = d->root_node->render_csg_term(m, &d->highlight_terms, &d->background_terms);
+  }
 
-  if (!root_raw_term)
+  if (!d->root_raw_term || progress_cancelled())
     goto fail;
 
   PRINT("Compiling design (CSG Products normalization)...");
-  if (procevents)
-    QApplication::processEvents();
+  compile_procevents(procevents);
 
-  root_norm_term = root_raw_term->link();
+  d->root_norm_term = d->root_raw_term->link();
+  normalize_term(d->root_norm_term);
 
-  while (1) {
-    CSGTerm *n = root_norm_term->normalize();
-    root_norm_term->unlink();
-    if (root_norm_term == n)
-      break;
-    root_norm_term = n;
+  // A NULL term means that all products have been pruned as empty
+  {
+    TraceSpan span("CSGChain::import");
+    d->root_chain = new CSGChain();
+    if (d->root_norm_term)
+      d->root_chain->import(d->root_norm_term);
   }
 
-  if (!root_norm_term)
-    goto fail;
-
-  root_chain = new CSGChain();
-  root_chain->import(root_norm_term);
-
-  if (root_chain->polysets.size() > 1000) {
-    PRINTF("WARNING: Normalized tree has %d elements!", root_chain->polysets.size());
+  if (d->root_chain->polysets.size() > 1000) {
+    PRINTF("WARNING: Normalized tree has %d elements!", d->root_chain->polysets.size());
     PRINTF("WARNING: OpenCSG rendering has been disabled.");
   } else {
-    enableOpenCSG = true;
-  }
-
-  if (highlight_terms.size() > 0) {
-    PRINTF("Compiling highlights (%d CSG Trees)...", highlight_terms.size());
-    if (procevents)
-      QApplication::processEvents();
-
-    highlights_chain = new CSGChain();
-    for (int i = 0; i < highlight_terms.size(); i++) {
-      while (1) {
-        CSGTerm *n = highlight_terms[i]->normalize();
-        highlight_terms[i]->unlink();
-        if (highlight_terms[i] == n)
-          break;
-        highlight_terms[i] = n;
-      }
-      highlights_chain->import(highlight_terms[i]);
+    d->enableOpenCSG = true;
+  }
+
+  if (d->highlight_terms.size() > 0) {
+    PRINTF("Compiling highlights (%d CSG Trees)...", d->highlight_terms.size());
+    compile_procevents(procevents);
+
+    d->highlights_chain = new CSGChain();
+    for (int i = 0; i < d->highlight_terms.size(); i++) {
+      normalize_term(d->highlight_terms[i]);
+      TraceSpan span("CSGChain::import");
+      if (d->highlight_terms[i])
+        d->highlights_chain->import(d->highlight_terms[i]);
     }
   }
 
-  if (background_terms.size() > 0) {
-    PRINTF("Compiling background (%d CSG Trees)...", background_terms.size());
-    if (procevents)
-      QApplication::processEvents();
+  if (d->background_terms.size() > 0) {
+    PRINTF("Compiling background (%d CSG Trees)...", d->background_terms.size());
+    compile_procevents(procevents);
 
-    background_chain = new CSGChain();
-    for (int i = 0; i < background_terms.size(); i++) {
-      while (1) {
-        CSGTerm *n = background_terms[i]->normalize();
-        background_terms[i]->unlink();
-        if (background_terms[i] == n)
-          break;
-        background_terms[i] = n;
-      }
-      background_chain->import(background_terms[i]);
+    d->background_chain = new CSGChain();
+    for (int i = 0; i < d->background_terms.size(); i++) {
+      normalize_term(d->background_terms[i]);
+      TraceSpan span("CSGChain::import");
+      if (d->background_terms[i])
+        d->background_chain->import(d->background_terms[i]);
     }
   }
 
-  if (1) {
-    PRINT("Compilation finished.");
-    if (procevents)
-      QApplication::processEvents();
-  } else {
+  if (progress_cancelled())
+    goto fail;
+
+  PRINT("Compilation finished.");
+  compile_procevents(procevents);
+  return d;
+
 fail:
+  if (!progress_cancelled()) {
     PRINT("ERROR: Compilation failed!");
-    if (procevents)
-      QApplication::processEvents();
+    compile_procevents(procevents);
   }
+  return d;
+}
+
+// Stops a background compile and drops its result
+void MainWindow::compile_abort() {
+  compile_timer->stop();
+  compile_pending = false;
+  if (!compile_running)
+    return;
+  compile_running = false;
+  compile_job->cancel();
+  compile_watcher->waitForFinished();
+  delete compile_watcher->result();
+  delete compile_job;
+  compile_job = NULL;
+}
+
+void MainWindow::compile(bool procevents) {
+  compile_abort();
+
+  root_ctx.set_variable("$t", Value(e_tval->text().toDouble()));
+  CompiledDesign *d = compile_design(editor->toPlainText().toLatin1(), e_tval->text().toDouble(), procevents);
+  swap(*d);
+  delete d;
+}
+
+// Edits are compiled in the background after a short pause in typing
+void MainWindow::compileDebounced() {
+  compile_timer->start(500);
+}
+
+static CompiledDesign *compile_design_job(ProgressJob *job, QByteArray source, double tval) {
+  ProgressJobScope scope(job);
+  return compile_design(source, tval, false);
+}
+
+void MainWindow::compileAsync(bool supersede) {
+  // The parser isn't reentrant, so there is only one compile worker. A new
+  // compile waits until the running one has finished; when the source has
+  // changed (supersede) the running one is cancelled first. Neither may a
+  // compile replace the design while a CGAL render is using it.
+  if (compile_running || compile_blocked > 0) {
+    compile_pending = true;
+    if (compile_running && supersede)
+      compile_job->cancel();
+    return;
+  }
+
+  current_win = this;
+  root_ctx.set_variable("$t", Value(e_tval->text().toDouble()));
+  compile_running = true;
+  compile_pending = false;
+  compile_job = new ProgressJob();
+  compile_watcher->setFuture(QtConcurrent::run(compile_design_job, compile_job,
+      editor->toPlainText().toLatin1(), e_tval->text().toDouble()));
+}
+
+void MainWindow::compileFinished() {
+  // Late signal of a compile that has already been aborted
+  if (!compile_running)
+    return;
+  compile_running = false;
+
+  CompiledDesign *d = compile_watcher->result();
+  bool cancelled = compile_job->cancelled();
+  delete compile_job;
+  compile_job = NULL;
+
+  // The GL view only reads the design from the GUI thread, so it sees either
+  // the old or the new design as a whole.
+  if (!cancelled) {
+    swap(*d);
+    screen->updateGL();
+  }
+  delete d;
+
+  if (compile_pending) {
+    compileAsync();
+    return;
+  }
+  current_win = NULL;
 }
 
 void MainWindow::actionNew() {
@@ -564,38 +703,65 @@ void MainWindow::actionReloadCompile() {
   console->clear();
 
   load();
-  compile(true);
-
-  {
-    screen->updateGL();
-  }
-  current_win = NULL;
+  compile_timer->stop();
+  compileAsync();
 }
 
 void MainWindow::actionCompile() {
   current_win = this;
   console->clear();
 
-  compile(!actViewModeAnimate->isChecked());
+  compile_timer->stop();
+  compileAsync();
+}
 
-  {
-    screen->updateGL();
+
+// A top level "$engine = \"mesh\";" selects the mesh engine for the whole design
+static bool design_uses_mesh_engine(const Module *m, const Context *ctx) {
+  bool mesh_engine = false;
+  for (int i = 0; i < m->assignments_var.size(); i++) {
+    if (m->assignments_var[i] != "$engine")
+      continue;
+    Value v = m->assignments_expr[i]->evaluate(ctx);
+    mesh_engine = v.type == Value::STRING && v.text == "mesh";
   }
-  current_win = NULL;
+  return mesh_engine;
 }
 
-
-static void report_func(const class AbstractNode*, void *vp, int mark) {
-  QProgressDialog *pd = (QProgressDialog*) vp;
-  int v = (int) ((mark * 100.0) / progress_report_count);
-  pd->setValue(v < 100 ? v : 99);
-  QString label;
-  label.sprintf("Rendering Polygon Mesh using CGAL (%d/%d)", mark, progress_report_count);
-  pd->setLabelText(label);
-  QApplication::processEvents();
+struct RenderCGALJob {
+  AbstractNode *root_node;
+  bool mesh_engine;
+  CGAL_Nef_polyhedron N;
+};
+
+static void render_cgal_job(void *vp) {
+  TraceSpan span("render CGAL");
+  RenderCGALJob *job = (RenderCGALJob*) vp;
+  if (job->mesh_engine) {
+    CGAL_Mesh M;
+    if (job->root_node->render_mesh(M)) {
+      // root_N is drawn and exported by the GUI thread
+      job->N = cgal_mesh_to_nef(M);
+      cgal_nef_make_exact(job->N);
+      return;
+    }
+    if (!progress_cancelled())
+      PRINT("WARNING: Design isn't made of closed manifold meshes, falling back to Nef polyhedra.");
+  }
+  job->N = job->root_node->render_cgal_nef_polyhedron().N;
 }
 
 void MainWindow::actionRenderCGAL() {
+  // Background compiles started meanwhile (e.g. by the animation) would
+  // replace the design under the render, so they wait until it has finished.
+  compile_blocked++;
+  render_cgal();
+  compile_blocked--;
+  if (compile_blocked == 0 && compile_pending)
+    compileAsync();
+}
+
+void MainWindow::render_cgal() {
   current_win = this;
   console->clear();
 
@@ -605,6 +771,7 @@ void MainWindow::actionRenderCGAL() {
     return;
 
   if (root_N) {
+    cgal_gl_forget(this);
     delete root_N;
     root_N = NULL;
   }
@@ -615,15 +782,22 @@ void MainWindow::actionRenderCGAL() {
   QTime t;
   t.start();
 
-  QProgressDialog *pd = new QProgressDialog("Rendering Polygon Mesh using CGAL...", QString(), 0, 100);
-  pd->setValue(0);
-  pd->setAutoClose(false);
-  pd->show();
-  QApplication::processEvents();
+  RenderCGALJob job;
+  job.root_node = root_node;
+  job.mesh_engine = design_uses_mesh_engine(root_module, &root_ctx);
 
-  progress_report_prep(root_node, report_func, pd);
-  root_N = new CGAL_Nef_polyhedron(root_node->render_cgal_nef_polyhedron());
-  progress_report_fin();
+  cgal_snap_moved.store(0);
+  profile_reset();
+  if (!progress_run(root_node, render_cgal_job, &job)) {
+    PRINT("Rendering cancelled.");
+    screen->updateGL();
+    current_win = NULL;
+    return;
+  }
+  root_N = new CGAL_Nef_polyhedron(job.N);
+
+  if (cgal_snap_moved.load() > 0)
+    PRINTF("Snap rounding moved %d vertices.", cgal_snap_moved.load());
 
   PRINTF("Number of vertices currently in CGAL cache: %d", AbstractNode::cgal_nef_cache.totalCost());
   PRINTF("Number of objects currently in CGAL cache: %d", AbstractNode::cgal_nef_cache.size());
@@ -649,6 +823,9 @@ void MainWindow::actionRenderCGAL() {
   int s = t.elapsed() / 1000;
   PRINTF("Total rendering time: %d hours, %d minutes, %d seconds", s / (60 * 60), (s / 60) % 60, s % 60);
 
+  if (profile_enabled)
+    PRINT(profile_report(20));
+
   if (!actViewModeCGALSurface->isChecked() && !actViewModeCGALGrid->isChecked()) {
     viewModeCGALSurface();
   } else {
@@ -657,7 +834,6 @@ void MainWindow::actionRenderCGAL() {
 
   PRINT("Rendering finished.");
 
-  delete pd;
   current_win = NULL;
 
 }
@@ -726,6 +902,8 @@ void MainWindow::actionExportSTL() {
     return;
   }
 
+  TraceSpan span("export STL");
+
   CGAL_Polyhedron P;
   root_N->convert_to_Polyhedron(P);
 
@@ -807,9 +985,104 @@ void MainWindow::actionExportOFF() {
   current_win = NULL;
 }
 
+void MainWindow::actionExportImage() {
+  current_win = this;
+  if (!root_raw_term) {
+    PRINT("Nothing to export! Try building first (press F5).");
+    current_win = NULL;
+    return;
+  }
+
+  QString png_filename = QFileDialog::getSaveFileName(this, "Export Ray Traced Image", "", "PNG Files (*.png)");
+  if (png_filename.isEmpty()) {
+    PRINT("No filename specified. Image export aborted.");
+    current_win = NULL;
+    return;
+  }
+
+  // The raw tree has all the CSG, not just the products the preview shows
+  QElapsedTimer timer;
+  timer.start();
+  QImage img = raytrace_term(root_raw_term, screen->width(), screen->height(),
+      screen->object_rot_y, screen->object_rot_z, screen->viewer_distance, 2);
+  if (!img.save(png_filename, "PNG")) {
+    PRINT("Can't write image file.");
+    current_win = NULL;
+    return;
+  }
+
+  PRINTF("Image export finished (%.1f s).", timer.nsecsElapsed() / 1e9);
+  current_win = NULL;
+}
+
+void MainWindow::actionProfile() {
+  profile_enabled = actDesignProfile->isChecked();
+}
+
+void MainWindow::actionExportProfile() {
+  current_win = this;
+  if (!profile_enabled) {
+    PRINT("No render profile! Enable profiling and render the design (press F6).");
+    current_win = NULL;
+    return;
+  }
+
+  QString json_filename = QFileDialog::getSaveFileName(this, "Export Render Profile", "", "JSON Files (*.json)");
+  if (json_filename.isEmpty()) {
+    PRINT("No filename specified. Profile export aborted.");
+    current_win = NULL;
+    return;
+  }
+
+  FILE *f = fopen(json_filename.toLatin1().data(), "w");
+  if (!f) {
+    PRINT("Can't open file for profile export.");
+    current_win = NULL;
+    return;
+  }
+  QByteArray json = profile_json();
+  fwrite(json.data(), 1, json.size(), f);
+  fclose(f);
+
+  PRINT("Profile export finished.");
+  current_win = NULL;
+}
+
+void MainWindow::actionTrace() {
+  if (actDesignTrace->isChecked())
+    trace_reset();
+  trace_enabled = actDesignTrace->isChecked();
+}
+
+void MainWindow::actionExportTrace() {
+  current_win = this;
+  QString json_filename = QFileDialog::getSaveFileName(this, "Export Trace", "", "Chrome Trace Files (*.json)");
+  if (json_filename.isEmpty()) {
+    PRINT("No filename specified. Trace export aborted.");
+    current_win = NULL;
+    return;
+  }
+
+  FILE *f = fopen(json_filename.toLatin1().data(), "w");
+  if (!f) {
+    PRINT("Can't open file for trace export.");
+    current_win = NULL;
+    return;
+  }
+  QByteArray json = trace_json();
+  fwrite(json.data(), 1, json.size(), f);
+  fclose(f);
+
+  PRINT("Trace export finished.");
+  current_win = NULL;
+}
+
 void MainWindow::viewModeActionsUncheck() {
   actViewModeCGALSurface->setChecked(false);
   actViewModeCGALGrid->setChecked(false);
+#ifdef ENABLE_OPENCSG
+  actViewModeOpenCSG->setChecked(false);
+#endif
   actViewModeThrownTogether->setChecked(false);
 }
 
@@ -830,12 +1103,38 @@ void MainWindow::viewModeActionsUncheck() {
 #include <CGAL/Nef_3/OGL_helper.h>
 #undef class
 
+// The conversion of root_N to display lists walks the whole Nef polyhedron,
+// so it is done once per render and not on every paint. The display lists
+// hold all styles, switching between surface and grid mode reuses them.
+struct CGALGLCache {
+  const CGAL_Nef_polyhedron *N;
+  CGAL::OGL::Polyhedron *P;
+};
+
+static QHash<const MainWindow*, CGALGLCache> cgal_gl_cache;
+
+// Must be called before root_N is deleted
+static void cgal_gl_forget(MainWindow *m) {
+  if (!cgal_gl_cache.contains(m))
+    return;
+  // The display lists belong to the GL context of the window
+  m->screen->makeCurrent();
+  delete cgal_gl_cache.take(m).P;
+}
+
 static void renderGLviaCGAL(void *vp) {
   MainWindow *m = (MainWindow*) vp;
   if (m->root_N) {
-    CGAL::OGL::Polyhedron P;
-    CGAL::OGL::Nef3_Converter<CGAL_Nef_polyhedron>::convert_to_OGLPolyhedron(*m->root_N, &P);
-    P.init();
+    if (!cgal_gl_cache.contains(m) || cgal_gl_cache[m].N != m->root_N) {
+      cgal_gl_forget(m);
+      CGALGLCache c;
+      c.N = m->root_N;
+      c.P = new CGAL::OGL::Polyhedron();
+      CGAL::OGL::Nef3_Converter<CGAL_Nef_polyhedron>::convert_to_OGLPolyhedron(*m->root_N, c.P);
+      c.P->init();
+      cgal_gl_cache[m] = c;
+    }
+    CGAL::OGL::Polyhedron &P = *cgal_gl_cache[m].P;
     if (m->actViewModeCGALSurface->isChecked())
       P.set_style(CGAL::OGL::SNC_BOUNDARY);
     if (m->actViewModeCGALGrid->isChecked())
@@ -876,45 +1175,143 @@ void MainWindow::viewModeCGALGrid() {
 }
 
 
-static void renderGLThrownTogetherChain(MainWindow *m, CSGChain *chain, bool highlight, bool background) {
-  glDepthFunc(GL_LEQUAL);
+// Appends the vertex data of a polyset moved by m, with the normals
+// transformed by GLBatch::normal_matrix().
+static void appendTransformed(GLBatch *batch, const GLBatch *src, const double *m) {
+  double c[9];
+  GLBatch::normal_matrix(m, c);
+
+  int n = batch->surface.size();
+  batch->surface.resize(n + src->surface.size());
+  const GLfloat *in = src->surface.constData();
+  GLfloat *out = batch->surface.data() + n;
+  for (int i = 0; i < src->surface.size(); i += 6, in += 6, out += 6) {
+    double nx = c[0]*in[0] + c[3]*in[1] + c[6]*in[2];
+    double ny = c[1]*in[0] + c[4]*in[1] + c[7]*in[2];
+    double nz = c[2]*in[0] + c[5]*in[1] + c[8]*in[2];
+    double nl = sqrt(nx*nx + ny*ny + nz*nz);
+    if (nl == 0)
+      nl = 1;
+    out[0] = nx / nl, out[1] = ny / nl, out[2] = nz / nl;
+    out[3] = m[0]*in[3] + m[4]*in[4] + m[8]*in[5] + m[12];
+    out[4] = m[1]*in[3] + m[5]*in[4] + m[9]*in[5] + m[13];
+    out[5] = m[2]*in[3] + m[6]*in[4] + m[10]*in[5] + m[14];
+  }
+
+  n = batch->edges.size();
+  batch->edges.resize(n + src->edges.size());
+  in = src->edges.constData();
+  out = batch->edges.data() + n;
+  for (int i = 0; i < src->edges.size(); i += 3, in += 3, out += 3) {
+    out[0] = m[0]*in[0] + m[4]*in[1] + m[8]*in[2] + m[12];
+    out[1] = m[1]*in[0] + m[5]*in[1] + m[9]*in[2] + m[13];
+    out[2] = m[2]*in[0] + m[6]*in[1] + m[10]*in[2] + m[14];
+  }
+}
+
+// Polysets with up to this many triangle vertices are merged into the
+// per-chain batches, up to a total that keeps the copies affordable.
+// Larger ones share their own buffers between all instances. Batches are
+// split so that they can be culled separately.
+#define THROWN_TOGETHER_MERGE_VERTICES 3000
+#define THROWN_TOGETHER_MERGE_TOTAL 4000000
+#define THROWN_TOGETHER_BATCH_VERTICES 65536
+
+static void prepareThrownTogetherChain(CSGChain *chain, bool highlight, bool background) {
   QHash<QPair<PolySet*, double*>, int> polySetVisitMark;
-  bool showEdges = m->actViewModeShowEdges->isChecked();
+  QHash<QPair<PolySet*, int>, int> groups;
+  QMap<int, GLBatch*> merged;
+  int merged_vertices = 0;
   for (int i = 0; i < chain->polysets.size(); i++) {
     if (polySetVisitMark[QPair<PolySet*, double*>(chain->polysets[i], chain->matrices[i])]++ > 0)
       continue;
-    glPushMatrix();
-    glMultMatrixd(chain->matrices[i]);
-    if (highlight) {
-      chain->polysets[i]->render_surface(PolySet::COLORMODE_HIGHLIGHT);
-      if (showEdges) {
-        glDisable(GL_LIGHTING);
-        chain->polysets[i]->render_edges(PolySet::COLORMODE_HIGHLIGHT);
-        glEnable(GL_LIGHTING);
+    PolySet *ps = chain->polysets[i];
+    PolySet::colormode_e colormode = chain->colormode(i, highlight, background);
+    ps->gl_prepare();
+    int vertices = ps->gl.surface.size() / 6;
+    if (vertices <= THROWN_TOGETHER_MERGE_VERTICES && merged_vertices + vertices <= THROWN_TOGETHER_MERGE_TOTAL) {
+      if (merged.contains(colormode) && merged[colormode]->surface.size() / 6 + vertices > THROWN_TOGETHER_BATCH_VERTICES) {
+        merged[colormode]->upload();
+        chain->gl_merged.append(qMakePair(colormode, merged[colormode]));
+        merged.remove(colormode);
       }
-    } else if (background) {
-      chain->polysets[i]->render_surface(PolySet::COLORMODE_BACKGROUND);
-      if (showEdges) {
-        glDisable(GL_LIGHTING);
-        chain->polysets[i]->render_edges(PolySet::COLORMODE_BACKGROUND);
-        glEnable(GL_LIGHTING);
-      }
-    } else if (chain->types[i] == CSGTerm::TYPE_DIFFERENCE) {
-      chain->polysets[i]->render_surface(PolySet::COLORMODE_CUTOUT);
-      if (showEdges) {
-        glDisable(GL_LIGHTING);
-        chain->polysets[i]->render_edges(PolySet::COLORMODE_CUTOUT);
-        glEnable(GL_LIGHTING);
-      }
-    } else {
-      chain->polysets[i]->render_surface(PolySet::COLORMODE_MATERIAL);
+      if (!merged.contains(colormode))
+        merged[colormode] = new GLBatch();
+      appendTransformed(merged[colormode], &ps->gl, chain->matrices[i]);
+      merged[colormode]->bbox.extend(ps->gl.bbox.transformed(chain->matrices[i]));
+      merged_vertices += vertices;
+      continue;
+    }
+    QPair<PolySet*, int> key(ps, colormode);
+    if (!groups.contains(key)) {
+      groups[key] = chain->gl_groups.size();
+      CSGChain::GLGroup group;
+      group.polyset = ps;
+      group.colormode = colormode;
+      chain->gl_groups.append(group);
+    }
+    chain->gl_groups[groups[key]].matrices.append(chain->matrices[i]);
+  }
+  foreach (int colormode, merged.keys()) {
+    merged[colormode]->upload();
+    chain->gl_merged.append(qMakePair((PolySet::colormode_e)colormode, merged[colormode]));
+  }
+  chain->gl_prepared = true;
+}
+
+// Detail level for a polyset covering the given number of pixels: the
+// decimated levels have 64 and 16 cells along the longest side, so a cell
+// stays around six pixels. One level coarser while the view is dragged.
+static int thrownTogetherLod(GLView *view, double size) {
+  int level = size > 400 ? 0 : size > 100 ? 1 : 2;
+  if (view->dragging())
+    level = qMin(level + 1, 2);
+  return level;
+}
+
+// One draw call per merged batch and per instance of the remaining
+// polysets, with the arrays of each polyset (or its decimated level) set up
+// only once. Everything outside the view frustum is skipped.
+static void renderGLThrownTogetherChain(MainWindow *m, CSGChain *chain, bool highlight, bool background) {
+  glDepthFunc(GL_LEQUAL);
+  if (!chain->gl_prepared)
+    prepareThrownTogetherChain(chain, highlight, background);
+  bool showEdges = m->actViewModeShowEdges->isChecked();
+  GLView *view = m->screen;
+  for (int i = 0; i < chain->gl_groups.size(); i++) {
+    const CSGChain::GLGroup &group = chain->gl_groups[i];
+    QVector<double*> levels[3];
+    for (int j = 0; j < group.matrices.size(); j++) {
+      double size = view->screen_size(group.polyset->gl.bbox, group.matrices[j]);
+      if (size == 0)
+        continue;
+      levels[thrownTogetherLod(view, size)].append(group.matrices[j]);
+    }
+    for (int level = 0; level < 3; level++) {
+      if (levels[level].isEmpty())
+        continue;
+      const GLBatch *batch = group.polyset->gl_lod(level);
+      PolySet::gl_color(group.colormode, false);
+      batch->render_surface(&levels[level]);
       if (showEdges) {
         glDisable(GL_LIGHTING);
-        chain->polysets[i]->render_edges(PolySet::COLORMODE_MATERIAL);
+        PolySet::gl_color(group.colormode, true);
+        batch->render_edges(&levels[level]);
         glEnable(GL_LIGHTING);
       }
     }
-    glPopMatrix();
+  }
+  for (int i = 0; i < chain->gl_merged.size(); i++) {
+    if (view->screen_size(chain->gl_merged[i].second->bbox) == 0)
+      continue;
+    PolySet::gl_color(chain->gl_merged[i].first, false);
+    chain->gl_merged[i].second->render_surface();
+    if (showEdges) {
+      glDisable(GL_LIGHTING);
+      PolySet::gl_color(chain->gl_merged[i].first, true);
+      chain->gl_merged[i].second->render_edges();
+      glEnable(GL_LIGHTING);
+    }
   }
 }
 
@@ -936,6 +1333,85 @@ void MainWindow::viewModeThrownTogether() {
   screen->updateGL();
 }
 
+#ifdef ENABLE_OPENCSG
+
+class OpenCSGPrim : public OpenCSG::Primitive {
+public:
+  PolySet *p;
+  double *m;
+
+  OpenCSGPrim(OpenCSG::Operation operation, unsigned int convexity, PolySet *p, double *m) :
+      OpenCSG::Primitive(operation, convexity), p(p), m(m) {
+  }
+
+  void render() {
+    glPushMatrix();
+    glMultMatrixd(m);
+    p->render_surface(PolySet::COLORMODE_NONE);
+    glPopMatrix();
+  }
+};
+
+// Each product of the normalized chain (a union entry followed by its
+// intersection and difference entries) is resolved into the depth buffer
+// by OpenCSG, then its primitives are drawn in color where they match it.
+static void renderCSGChainviaOpenCSG(CSGChain *chain, bool highlight, bool background) {
+  std::vector<OpenCSG::Primitive*> primitives;
+  int j = 0;
+  for (int i = 0;; i++) {
+    bool last = i == chain->polysets.size();
+    if (last || chain->types[i] == CSGTerm::TYPE_UNION) {
+      if (primitives.size() > 0) {
+        OpenCSG::render(primitives);
+        glDepthFunc(GL_EQUAL);
+        for (; j < i; j++) {
+          glPushMatrix();
+          glMultMatrixd(chain->matrices[j]);
+          chain->polysets[j]->render_surface(chain->colormode(j, highlight, background));
+          glPopMatrix();
+        }
+        glDepthFunc(GL_LESS);
+        for (unsigned int k = 0; k < primitives.size(); k++)
+          delete primitives[k];
+        primitives.clear();
+      }
+      if (last)
+        break;
+    }
+    OpenCSG::Operation operation = chain->types[i] == CSGTerm::TYPE_DIFFERENCE ? OpenCSG::Subtraction : OpenCSG::Intersection;
+    primitives.push_back(new OpenCSGPrim(operation, chain->polysets[i]->convexity, chain->polysets[i], chain->matrices[i]));
+  }
+}
+
+static void renderGLviaOpenCSG(void *vp) {
+  MainWindow *m = (MainWindow*) vp;
+  // Chains too big for OpenCSG (see compile_design()) are thrown together
+  if (!m->enableOpenCSG) {
+    renderGLThrownTogether(vp);
+    return;
+  }
+  if (m->root_chain)
+    renderCSGChainviaOpenCSG(m->root_chain, false, false);
+  if (m->background_chain)
+    renderCSGChainviaOpenCSG(m->background_chain, false, true);
+  if (m->highlights_chain) {
+    // Highlights are shown through everything else. OpenCSG needs the depth
+    // test for the CSG itself, so only the depth values drawn so far are dropped.
+    glClear(GL_DEPTH_BUFFER_BIT);
+    renderCSGChainviaOpenCSG(m->highlights_chain, true, false);
+  }
+}
+
+void MainWindow::viewModeOpenCSG() {
+  viewModeActionsUncheck();
+  actViewModeOpenCSG->setChecked(true);
+  screen->renderfunc = renderGLviaOpenCSG;
+  screen->renderfunc_vp = this;
+  screen->updateGL();
+}
+
+#endif /* ENABLE_OPENCSG */
+
 void MainWindow::viewModeShowEdges() {
   screen->updateGL();
 }
@@ -0,0 +1,264 @@
+/*
+ *  OpenSCAD (www.openscad.at)
+ *  Copyright (C) 2009  Clifford Wolf <clifford@clifford.at>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#define INCLUDE_ABSTRACT_NODE_DETAILS
+
+#include "openscad.h"
+
+#include <CGAL/Polygon_mesh_processing/corefinement.h>
+#include <CGAL/Polygon_mesh_processing/self_intersections.h>
+#include <CGAL/Polygon_mesh_processing/orientation.h>
+#include <CGAL/Polygon_mesh_processing/triangulate_faces.h>
+#include <algorithm>
+#include <vector>
+
+namespace PMP = CGAL::Polygon_mesh_processing;
+
+typedef CGAL_Mesh::Vertex_index CGAL_Mesh_vertex;
+typedef CGAL_Mesh::Face_index CGAL_Mesh_face;
+
+bool PolySet::render_mesh(CGAL_Mesh &M) const {
+  M.clear();
+
+  Grid3d<CGAL_Mesh_vertex> vertices_idx;
+  for (int i = 0; i < polygons.size(); i++) {
+    const Polygon *poly = &polygons[i];
+    std::vector<CGAL_Mesh_vertex> face;
+    for (int j = 0; j < poly->size(); j++) {
+      const Point *p = &poly->at(j);
+      if (!vertices_idx.has(p->x, p->y, p->z))
+        vertices_idx.data(p->x, p->y, p->z) = M.add_vertex(CGAL_Mesh_kernel::Point_3(p->x, p->y, p->z));
+      CGAL_Mesh_vertex v = vertices_idx.data(p->x, p->y, p->z);
+      if (std::find(face.begin(), face.end(), v) == face.end())
+        face.push_back(v);
+    }
+    if (face.size() < 3)
+      continue;
+    // add_face() refuses faces that would make the mesh non-manifold
+    if (M.add_face(face) == CGAL_Mesh::null_face())
+      return false;
+  }
+
+  if (M.is_empty())
+    return true;
+  if (!CGAL::is_closed(M))
+    return false;
+  if (!PMP::triangulate_faces(M))
+    return false;
+  if (PMP::does_self_intersect(M))
+    return false;
+  if (!PMP::is_outward_oriented(M))
+    PMP::reverse_face_orientations(M);
+  return true;
+}
+
+bool cgal_mesh_combine(CGAL_Mesh &M, const CGAL_Mesh &other, CSGTerm::type_e op) {
+  if (op == CSGTerm::TYPE_UNION) {
+    if (other.is_empty())
+      return true;
+    if (M.is_empty()) {
+      M = other;
+      return true;
+    }
+  } else if (op == CSGTerm::TYPE_INTERSECTION) {
+    if (M.is_empty())
+      return true;
+    if (other.is_empty()) {
+      M.clear();
+      return true;
+    }
+  } else if (op == CSGTerm::TYPE_DIFFERENCE) {
+    if (M.is_empty() || other.is_empty())
+      return true;
+  }
+
+  // Corefinement inserts the intersection curves into both input meshes,
+  // so it works on copies. It returns false if the result would not be a
+  // closed manifold mesh.
+  CGAL_Mesh a = M, b = other, result;
+  bool ok = false;
+  if (op == CSGTerm::TYPE_UNION)
+    ok = PMP::corefine_and_compute_union(a, b, result);
+  if (op == CSGTerm::TYPE_INTERSECTION)
+    ok = PMP::corefine_and_compute_intersection(a, b, result);
+  if (op == CSGTerm::TYPE_DIFFERENCE)
+    ok = PMP::corefine_and_compute_difference(a, b, result);
+  if (!ok)
+    return false;
+
+  result.collect_garbage();
+  M = result;
+  return true;
+}
+
+void cgal_mesh_transform(CGAL_Mesh &M, const double m[16]) {
+  CGAL_Mesh::Vertex_range vr = M.vertices();
+  for (CGAL_Mesh::Vertex_range::iterator vi = vr.begin(); vi != vr.end(); ++vi) {
+    CGAL_Mesh_vertex v = *vi;
+    const CGAL_Mesh_kernel::Point_3 &p = M.point(v);
+    double x = p.x(), y = p.y(), z = p.z();
+    double w = m[3]*x + m[7]*y + m[11]*z + m[15];
+    M.point(v) = CGAL_Mesh_kernel::Point_3(
+        (m[0]*x + m[4]*y + m[ 8]*z + m[12]) / w,
+        (m[1]*x + m[5]*y + m[ 9]*z + m[13]) / w,
+        (m[2]*x + m[6]*y + m[10]*z + m[14]) / w);
+  }
+
+  // Mirroring turns the mesh inside out
+  double det = m[0] * (m[5]*m[10] - m[9]*m[6]) -
+      m[4] * (m[1]*m[10] - m[9]*m[2]) +
+      m[8] * (m[1]*m[6] - m[5]*m[2]);
+  if (det < 0)
+    PMP::reverse_face_orientations(M);
+}
+
+bool cgal_mesh_snap(CGAL_Mesh &M, double grid) {
+  // Same rounding as cgal_nef_snap(), so both engines produce the same
+  // coordinates for the same grid.
+  CGAL_Mesh snapped = M;
+  int moved = 0;
+  CGAL_Mesh::Vertex_range vr = snapped.vertices();
+  for (CGAL_Mesh::Vertex_range::iterator vi = vr.begin(); vi != vr.end(); ++vi) {
+    const CGAL_Mesh_kernel::Point_3 &p = snapped.point(*vi);
+    CGAL_Mesh_kernel::Point_3 q(round(p.x() / grid) * grid,
+        round(p.y() / grid) * grid, round(p.z() / grid) * grid);
+    if (q != p) {
+      snapped.point(*vi) = q;
+      moved++;
+    }
+  }
+  if (moved == 0)
+    return true;
+  // Vertices moved onto each other or onto a line leave degenerate
+  // triangles behind, the corefinement doesn't accept those
+  CGAL_Mesh::Face_range fr = snapped.faces();
+  for (CGAL_Mesh::Face_range::iterator fi = fr.begin(); fi != fr.end(); ++fi) {
+    CGAL_Mesh::Halfedge_index h = snapped.halfedge(*fi);
+    if (CGAL::collinear(snapped.point(snapped.source(h)), snapped.point(snapped.target(h)),
+          snapped.point(snapped.target(snapped.next(h)))))
+      return false;
+  }
+  if (!CGAL::is_closed(snapped) || PMP::does_self_intersect(snapped))
+    return false;
+
+  M = snapped;
+  cgal_snap_moved.fetchAndAddOrdered(moved);
+  return true;
+}
+
+PolySet *cgal_mesh_to_polyset(const CGAL_Mesh &M) {
+  PolySet *ps = new PolySet();
+  CGAL_Mesh::Face_range fr = M.faces();
+  for (CGAL_Mesh::Face_range::iterator fi = fr.begin(); fi != fr.end(); ++fi) {
+    ps->append_poly();
+    CGAL::Vertex_around_face_iterator<CGAL_Mesh> vi, vi_end;
+    for (boost::tie(vi, vi_end) = CGAL::vertices_around_face(M.halfedge(*fi), M); vi != vi_end; ++vi) {
+      const CGAL_Mesh_kernel::Point_3 &p = M.point(*vi);
+      ps->append_vertex(p.x(), p.y(), p.z());
+    }
+  }
+  return ps;
+}
+
+CGAL_Nef_polyhedron cgal_mesh_to_nef(const CGAL_Mesh &M) {
+  PolySet *ps = cgal_mesh_to_polyset(M);
+  CGAL_Nef_polyhedron N = ps->render_cgal_nef_polyhedron();
+  ps->unlink();
+  return N;
+}
+
+QCache<QString, CGAL_Mesh> AbstractNode::cgal_mesh_cache(100000);
+QMutex AbstractNode::cgal_mesh_cache_mutex;
+
+bool AbstractNode::cgal_mesh_cache_lookup(const QString &cache_id, CGAL_Mesh &M) {
+  TraceSpan span("cgal_mesh_cache_lookup");
+  QMutexLocker locker(&cgal_mesh_cache_mutex);
+  CGAL_Mesh *cached = cgal_mesh_cache.object(cache_id);
+  if (!cached)
+    return false;
+  M = *cached;
+  return true;
+}
+
+void AbstractNode::cgal_mesh_cache_insert(const QString &cache_id, const CGAL_Mesh &M) {
+  QMutexLocker locker(&cgal_mesh_cache_mutex);
+  cgal_mesh_cache.insert(cache_id, new CGAL_Mesh(M), M.number_of_vertices());
+}
+
+bool AbstractNode::render_mesh_children(CGAL_Mesh &M, CSGTerm::type_e op) const {
+  M.clear();
+  bool first = true;
+  foreach(AbstractNode *v, children) {
+    if (progress_cancelled())
+      return false;
+    if (v->modinst->tag_background)
+      continue;
+    CGAL_Mesh child;
+    if (!v->render_mesh(child))
+      return false;
+    if (first) {
+      M = child;
+      first = false;
+    } else if (!cgal_mesh_combine(M, child, op)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool AbstractNode::render_mesh(CGAL_Mesh &M) const {
+  TraceSpan span("render_mesh", this);
+  QString cache_id = mk_cache_id();
+  if (cgal_mesh_cache_lookup(cache_id, M)) {
+    progress_report();
+    return true;
+  }
+
+  if (!render_mesh_children(M, CSGTerm::TYPE_UNION))
+    return false;
+
+  cgal_mesh_cache_insert(cache_id, M);
+  progress_report();
+  return true;
+}
+
+bool AbstractPolyNode::render_mesh(CGAL_Mesh &M) const {
+  TraceSpan span("render_mesh", this);
+  QString cache_id = mk_cache_id();
+  if (cgal_mesh_cache_lookup(cache_id, M)) {
+    progress_report();
+    return true;
+  }
+
+  if (progress_cancelled())
+    return false;
+
+  PolySet *ps = render_polyset(RENDER_CGAL);
+  bool ok = ps && ps->render_mesh(M);
+  if (ps)
+    ps->unlink();
+  if (!ok)
+    return false;
+
+  cgal_mesh_cache_insert(cache_id, M);
+  progress_report();
+  return true;
+}
+
@@ -0,0 +1,561 @@
+/*
+ *  OpenSCAD (www.openscad.at)
+ *  Copyright (C) 2009  Clifford Wolf <clifford@clifford.at>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#define INCLUDE_ABSTRACT_NODE_DETAILS
+
+#include "openscad.h"
+
+#include <QCoreApplication>
+#include <QTemporaryFile>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#endif
+
+// Microbenchmark mode: "openscad --microbench [-r repeats] [name ...]" runs
+// focused loops over the core data structures. Every benchmark has a fixed
+// iteration count so the numbers can be compared between builds. The best
+// of a few repetitions is reported, together with the hardware counters if
+// the kernel lets us read them.
+
+static const char *mb_counter_names[] = {
+  "cycles", "instructions", "cache-misses", "branch-misses"
+};
+
+#define MB_COUNTERS 4
+
+class MicroTimer {
+public:
+  qint64 nsecs;
+  quint64 counters[MB_COUNTERS];
+  bool have_counters;
+
+  MicroTimer();
+  ~MicroTimer();
+  void start();
+  void stop();
+
+private:
+  QElapsedTimer timer;
+  int fd[MB_COUNTERS];
+};
+
+#ifdef __linux__
+
+static int mb_perf_open(quint64 config, int group_fd) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = config;
+  attr.disabled = group_fd < 0;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP;
+  return syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+MicroTimer::MicroTimer() {
+  static const quint64 configs[MB_COUNTERS] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+  };
+  nsecs = 0;
+  have_counters = true;
+  for (int i = 0; i < MB_COUNTERS; i++) {
+    counters[i] = 0;
+    fd[i] = mb_perf_open(configs[i], i == 0 ? -1 : fd[0]);
+    if (fd[i] < 0)
+      have_counters = false;
+  }
+}
+
+MicroTimer::~MicroTimer() {
+  for (int i = 0; i < MB_COUNTERS; i++) {
+    if (fd[i] >= 0)
+      close(fd[i]);
+  }
+}
+
+void MicroTimer::start() {
+  if (have_counters) {
+    ioctl(fd[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(fd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  }
+  timer.start();
+}
+
+void MicroTimer::stop() {
+  nsecs = timer.nsecsElapsed();
+  if (have_counters) {
+    ioctl(fd[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    quint64 buf[1 + MB_COUNTERS];
+    if (read(fd[0], buf, sizeof(buf)) == sizeof(buf)) {
+      for (int i = 0; i < MB_COUNTERS; i++)
+        counters[i] = buf[1 + i];
+    } else {
+      have_counters = false;
+    }
+  }
+}
+
+#else
+
+MicroTimer::MicroTimer() {
+  nsecs = 0;
+  have_counters = false;
+  for (int i = 0; i < MB_COUNTERS; i++) {
+    counters[i] = 0;
+    fd[i] = -1;
+  }
+}
+
+MicroTimer::~MicroTimer() {
+}
+
+void MicroTimer::start() {
+  timer.start();
+}
+
+void MicroTimer::stop() {
+  nsecs = timer.nsecsElapsed();
+}
+
+#endif
+
+// Keeps the compiler from optimizing the measured work away
+static volatile double mb_sink;
+
+// ---- Grid3d
+
+static void mb_grid3d(MicroTimer &t, int iterations, double spacing, bool has) {
+  Grid3d<int> grid;
+  for (int x = 0; x < 20; x++)
+    for (int y = 0; y < 20; y++)
+      for (int z = 0; z < 20; z++)
+        grid.data(x * spacing, y * spacing, z * spacing) = x;
+
+  double sum = 0;
+  t.start();
+  for (int i = 0; i < iterations; i++) {
+    double x = (i % 23) * spacing * 0.97;
+    double y = (i % 19) * spacing * 1.01;
+    double z = (i % 17) * spacing * 0.99;
+    if (has)
+      sum += grid.has(x, y, z);
+    else
+      sum += grid.align(x, y, z);
+  }
+  t.stop();
+  mb_sink = sum;
+}
+
+// Neighbouring cells occupied: align() has to search all 27 of them
+static void mb_grid3d_align_dense(MicroTimer &t, int iterations) {
+  mb_grid3d(t, iterations, 0.001, false);
+}
+
+static void mb_grid3d_align_sparse(MicroTimer &t, int iterations) {
+  mb_grid3d(t, iterations, 1.0, false);
+}
+
+static void mb_grid3d_has_dense(MicroTimer &t, int iterations) {
+  mb_grid3d(t, iterations, 0.001, true);
+}
+
+static void mb_grid3d_has_sparse(MicroTimer &t, int iterations) {
+  mb_grid3d(t, iterations, 1.0, true);
+}
+
+// ---- Value
+
+static Value mb_vector(int n) {
+  Value v;
+  v.type = Value::VECTOR;
+  for (int i = 0; i < n; i++)
+    v.vec.append(new Value(double(i)));
+  return v;
+}
+
+static void mb_value_copy(MicroTimer &t, int iterations) {
+  Value v = mb_vector(1000);
+  t.start();
+  for (int i = 0; i < iterations; i++) {
+    Value copy(v);
+    mb_sink = copy.vec.size();
+  }
+  t.stop();
+}
+
+static void mb_value_add(MicroTimer &t, int iterations) {
+  Value a = mb_vector(1000), b = mb_vector(1000);
+  t.start();
+  for (int i = 0; i < iterations; i++) {
+    Value r = a + b;
+    mb_sink = r.vec.size();
+  }
+  t.stop();
+}
+
+static void mb_value_mul(MicroTimer &t, int iterations) {
+  Value a = mb_vector(1000), s(2.0);
+  t.start();
+  for (int i = 0; i < iterations; i++) {
+    Value r = a * s;
+    mb_sink = r.vec.size();
+  }
+  t.stop();
+}
+
+// ---- Expression::evaluate()
+
+static struct {
+  const char *opcode;
+  const char *expr;
+} mb_expressions[] = {
+  { "C", "42" },
+  { "L", "a" },
+  { "N", "v.x" },
+  { "[]", "v[1]" },
+  { "I", "-a" },
+  { "!", "!t" },
+  { "&&", "t && t" },
+  { "+", "a + b" },
+  { "*", "a * b" },
+  { "%", "a % b" },
+  { "<", "a < b" },
+  { "==", "a == b" },
+  { "?:", "t ? a : b" },
+  { "V", "[a, b, a]" },
+  { "R", "[0:1:a]" },
+  { "F", "sin(a)" },
+  { NULL, NULL }
+};
+
+static void mb_expression(MicroTimer &t, int iterations, const char *source) {
+  QString text = QString("x = %1;").arg(source);
+  Module *m = (Module*) parse(text.toLatin1().data(), false);
+  if (!m || m->assignments_expr.isEmpty()) {
+    delete m;
+    return;
+  }
+
+  Context ctx;
+  init_root_ctx(&ctx, 0.0);
+  ctx.set_variable("a", Value(7.0));
+  ctx.set_variable("b", Value(3.0));
+  ctx.set_variable("t", Value(true));
+  Value v = mb_vector(3);
+  ctx.set_variable("v", v);
+
+  Expression *e = m->assignments_expr[0];
+  t.start();
+  for (int i = 0; i < iterations; i++) {
+    Value r = e->evaluate(&ctx);
+    mb_sink = r.num;
+  }
+  t.stop();
+  delete m;
+}
+
+// ---- Context::lookup_variable()
+
+static void mb_context_lookup(MicroTimer &t, int iterations, int depth) {
+  QVector<Context*> stack;
+  stack.append(new Context());
+  stack.first()->set_variable("x", Value(1.0));
+  for (int i = 1; i < depth; i++) {
+    stack.append(new Context(stack.last()));
+    stack.last()->set_variable(QString("y%1").arg(i), Value(double(i)));
+  }
+
+  QString name = "x";
+  t.start();
+  for (int i = 0; i < iterations; i++)
+    mb_sink = stack.last()->lookup_variable(name).num;
+  t.stop();
+
+  while (!stack.isEmpty())
+    delete stack.takeLast();
+}
+
+static void mb_context_lookup_1(MicroTimer &t, int iterations) {
+  mb_context_lookup(t, iterations, 1);
+}
+
+static void mb_context_lookup_8(MicroTimer &t, int iterations) {
+  mb_context_lookup(t, iterations, 8);
+}
+
+static void mb_context_lookup_64(MicroTimer &t, int iterations) {
+  mb_context_lookup(t, iterations, 64);
+}
+
+// ---- CSGTerm::normalize()
+
+// A tree like the ones for "difference() { A; for (...) B; }" nested depth
+// levels deep, with intersections every other level.
+static CSGTerm *mb_csg_tree(PolySet *ps, int depth, int width) {
+  double m[16];
+  for (int i = 0; i < 16; i++)
+    m[i] = i % 5 == 0 ? 1.0 : 0.0;
+  if (depth == 0)
+    return new CSGTerm(ps->link(), m, QString());
+  CSGTerm *sub = new CSGTerm(ps->link(), m, QString());
+  for (int i = 1; i < width; i++)
+    sub = new CSGTerm(CSGTerm::TYPE_UNION, sub, new CSGTerm(ps->link(), m, QString()));
+  CSGTerm::type_e type = depth % 2 ? CSGTerm::TYPE_DIFFERENCE : CSGTerm::TYPE_INTERSECTION;
+  return new CSGTerm(type, mb_csg_tree(ps, depth - 1, width), sub);
+}
+
+static void mb_csgterm_normalize(MicroTimer &t, int iterations, int depth, int width) {
+  // All primitives overlap, so the bounding boxes don't prune anything
+  PolySet *ps = new PolySet();
+  ps->append_poly();
+  ps->append_vertex(0, 0, 0);
+  ps->append_vertex(1, 0, 0);
+  ps->append_vertex(0, 1, 1);
+  QVector<CSGTerm*> terms;
+  for (int i = 0; i < iterations; i++)
+    terms.append(mb_csg_tree(ps, depth, width));
+
+  t.start();
+  for (int i = 0; i < iterations; i++)
+    normalize_term(terms[i]);
+  t.stop();
+
+  for (int i = 0; i < iterations; i++) {
+    if (terms[i])
+      terms[i]->unlink();
+  }
+  ps->unlink();
+}
+
+static void mb_csgterm_normalize_deep(MicroTimer &t, int iterations) {
+  mb_csgterm_normalize(t, iterations, 8, 2);
+}
+
+static void mb_csgterm_normalize_wide(MicroTimer &t, int iterations) {
+  mb_csgterm_normalize(t, iterations, 2, 16);
+}
+
+// ---- dxf_tesselate()
+
+static void mb_dxf_tesselate(MicroTimer &t, int iterations, int holes) {
+  QTemporaryFile f;
+  if (!f.open())
+    return;
+
+  // A square plate with a grid of round holes
+  int n = (int) ceil(sqrt(holes));
+  double size = n * 10;
+  f.write("0\nSECTION\n2\nENTITIES\n");
+  double sq[5][2] = { {0, 0}, {size, 0}, {size, size}, {0, size}, {0, 0} };
+  for (int i = 0; i < 4; i++)
+    f.write(QString("0\nLINE\n8\n0\n10\n%1\n20\n%2\n11\n%3\n21\n%4\n").arg(sq[i][0]).arg(sq[i][1]).arg(sq[i + 1][0]).arg(sq[i + 1][1]).toLatin1());
+  for (int i = 0; i < holes; i++)
+    f.write(QString("0\nCIRCLE\n8\n0\n10\n%1\n20\n%2\n40\n3\n").arg((i % n) * 10 + 5).arg((i / n) * 10 + 5).toLatin1());
+  f.write("0\nENDSEC\n0\nEOF\n");
+  f.close();
+
+  DxfData dxf(16, 1, 12, f.fileName());
+  t.start();
+  for (int i = 0; i < iterations; i++) {
+    PolySet *ps = new PolySet();
+    dxf_tesselate(ps, &dxf, 0, false, 0);
+    mb_sink = ps->polygons.size();
+    ps->unlink();
+  }
+  t.stop();
+}
+
+static void mb_dxf_tesselate_10(MicroTimer &t, int iterations) {
+  mb_dxf_tesselate(t, iterations, 10);
+}
+
+static void mb_dxf_tesselate_100(MicroTimer &t, int iterations) {
+  mb_dxf_tesselate(t, iterations, 100);
+}
+
+// ---- sphere generation, fragment count from get_fragments_from_r()
+
+static void mb_sphere(MicroTimer &t, int iterations, const char *source) {
+  AbstractModule *m = parse(source, false);
+  Context ctx;
+  init_root_ctx(&ctx, 0.0);
+  ModuleInstanciation root_inst;
+  AbstractNode *root = m ? m->evaluate(&ctx, &root_inst) : NULL;
+  if (!root || root->children.isEmpty()) {
+    delete root;
+    delete m;
+    return;
+  }
+
+  AbstractPolyNode *node = (AbstractPolyNode*) root->children[0];
+  t.start();
+  for (int i = 0; i < iterations; i++) {
+    PolySet *ps = node->render_polyset(AbstractPolyNode::RENDER_OPENCSG);
+    mb_sink = ps->polygons.size();
+    ps->unlink();
+  }
+  t.stop();
+  delete root;
+  delete m;
+}
+
+static void mb_sphere_r10(MicroTimer &t, int iterations) {
+  mb_sphere(t, iterations, "sphere(r = 10);");
+}
+
+static void mb_sphere_r100(MicroTimer &t, int iterations) {
+  mb_sphere(t, iterations, "sphere(r = 100, $fs = 0.5, $fa = 2);");
+}
+
+static struct {
+  const char *name;
+  int iterations;
+  void (*run)(MicroTimer &t, int iterations);
+} mb_list[] = {
+  { "grid3d_align_dense", 100000, mb_grid3d_align_dense },
+  { "grid3d_align_sparse", 100000, mb_grid3d_align_sparse },
+  { "grid3d_has_dense", 100000, mb_grid3d_has_dense },
+  { "grid3d_has_sparse", 100000, mb_grid3d_has_sparse },
+  { "value_copy", 1000, mb_value_copy },
+  { "value_add", 1000, mb_value_add },
+  { "value_mul", 1000, mb_value_mul },
+  { "context_lookup_1", 100000, mb_context_lookup_1 },
+  { "context_lookup_8", 100000, mb_context_lookup_8 },
+  { "context_lookup_64", 100000, mb_context_lookup_64 },
+  { "csgterm_normalize_deep", 10, mb_csgterm_normalize_deep },
+  { "csgterm_normalize_wide", 10, mb_csgterm_normalize_wide },
+  { "dxf_tesselate_10", 100, mb_dxf_tesselate_10 },
+  { "dxf_tesselate_100", 10, mb_dxf_tesselate_100 },
+  { "sphere_r10", 1000, mb_sphere_r10 },
+  { "sphere_r100", 10, mb_sphere_r100 },
+  { NULL, 0, NULL }
+};
+
+static void mb_report(const QString &name, int iterations, const MicroTimer &best) {
+  printf("%-26s %10d %12.1f", name.toLatin1().data(), iterations, double(best.nsecs) / iterations);
+  if (best.have_counters) {
+    for (int i = 0; i < MB_COUNTERS; i++)
+      printf(" %12.1f", double(best.counters[i]) / iterations);
+  }
+  printf("\n");
+}
+
+static bool mb_selected(const QStringList &names, const QString &name) {
+  if (names.isEmpty())
+    return true;
+  foreach(const QString &n, names) {
+    if (name.startsWith(n))
+      return true;
+  }
+  return false;
+}
+
+// Runs the benchmark repeats times and keeps the fastest run
+template <typename F>
+static MicroTimer *mb_best(int repeats, F run) {
+  MicroTimer *best = NULL;
+  for (int r = 0; r < repeats; r++) {
+    MicroTimer *t = new MicroTimer();
+    run(*t);
+    if (!best || t->nsecs < best->nsecs) {
+      delete best;
+      best = t;
+    } else {
+      delete t;
+    }
+  }
+  return best;
+}
+
+struct MbListRun {
+  int i;
+  void operator()(MicroTimer &t) const {
+    mb_list[i].run(t, mb_list[i].iterations);
+  }
+};
+
+struct MbExpressionRun {
+  int i;
+  void operator()(MicroTimer &t) const {
+    mb_expression(t, 100000, mb_expressions[i].expr);
+  }
+};
+
+int microbench_main(int argc, char **argv) {
+  QCoreApplication app(argc, argv);
+  QStringList names;
+  int repeats = 5;
+
+  for (int i = 2; i < argc; i++) {
+    QString arg = argv[i];
+    if (arg == "-r" && i + 1 < argc) {
+      repeats = qMax(atoi(argv[++i]), 1);
+    } else if (arg == "-l") {
+      for (int j = 0; mb_list[j].name; j++)
+        printf("%s\n", mb_list[j].name);
+      for (int j = 0; mb_expressions[j].opcode; j++)
+        printf("expr_%s\n", mb_expressions[j].opcode);
+      return 0;
+    } else if (arg.startsWith("-")) {
+      fprintf(stderr, "Usage: openscad --microbench [-r repeats] [-l] [name_prefix ...]\n");
+      return 1;
+    } else {
+      names.append(arg);
+    }
+  }
+
+  MicroTimer probe;
+  printf("%-26s %10s %12s", "benchmark", "iterations", "ns/iter");
+  if (probe.have_counters) {
+    for (int i = 0; i < MB_COUNTERS; i++)
+      printf(" %12s", mb_counter_names[i]);
+  } else {
+    printf("  (hardware counters not available)");
+  }
+  printf("\n");
+
+  for (int i = 0; mb_list[i].name; i++) {
+    if (!mb_selected(names, mb_list[i].name))
+      continue;
+    MbListRun run = { i };
+    MicroTimer *best = mb_best(repeats, run);
+    mb_report(mb_list[i].name, mb_list[i].iterations, *best);
+    delete best;
+  }
+
+  for (int i = 0; mb_expressions[i].opcode; i++) {
+    QString name = QString("expr_%1").arg(mb_expressions[i].opcode);
+    if (!mb_selected(names, name))
+      continue;
+    MbExpressionRun run = { i };
+    MicroTimer *best = mb_best(repeats, run);
+    mb_report(name, 100000, *best);
+    delete best;
+  }
+
+  return 0;
+}
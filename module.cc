@@ -22,6 +22,10 @@
 
 #include "openscad.h"
 
+#include <QCoreApplication>
+#include <QThreadStorage>
+#include <QtConcurrentRun>
+
 AbstractModule::~AbstractModule() {
 }
 
@@ -198,6 +202,7 @@ int AbstractNode::idx_counter;
 AbstractNode::AbstractNode(const ModuleInstanciation *mi) {
   modinst = mi;
   idx = idx_counter++;
+  snap_grid = 0;
 }
 
 AbstractNode::~AbstractNode() {
@@ -211,28 +216,139 @@ QString AbstractNode::mk_cache_id() const {
   cache_id.remove(' ');
   cache_id.remove('\t');
   cache_id.remove('\n');
+  // Leaves are never snap rounded, only transformations and the render()
+  // node itself. So leaves share their cache entries (Nef, mesh and polyset)
+  // with and without an enclosing render(snap = ..).
+  if (snap_grid > 0 && !dynamic_cast<const AbstractPolyNode*>(this))
+    cache_id += QString("snap=%1").arg(snap_grid);
   return cache_id;
 }
 
+void AbstractNode::set_snap_grid(double grid) {
+  // An inner render(snap = ..) keeps its own grid
+  if (snap_grid > 0)
+    return;
+  snap_grid = grid;
+  foreach(AbstractNode *v, children)
+  v->set_snap_grid(grid);
+}
 
-QCache<QString, CGAL_Nef_polyhedron> AbstractNode::cgal_nef_cache(100000);
 
-CGAL_Nef_polyhedron AbstractNode::render_cgal_nef_polyhedron() const {
-  QString cache_id = mk_cache_id();
-  if (cgal_nef_cache.contains(cache_id)) {
-    progress_report();
-    return *cgal_nef_cache[cache_id];
+QCache<QString, CGAL_Nef_operand> AbstractNode::cgal_nef_cache(100000);
+QMutex AbstractNode::cgal_nef_cache_mutex;
+
+// Nef polyhedra share their representation by reference counting, and the
+// handles cross thread boundaries when sibling results are combined or cached.
+// That is only safe when CGAL was built with thread safe reference counting.
+// The lazy kernel additionally evaluates its values in place the first time an
+// exact value is needed, so every result is made exact before it is cached or
+// handed to another thread (see cgal_nef_make_exact()).
+#if defined(CGAL_HAS_THREADS)
+int cgal_render_threads = QThread::idealThreadCount();
+#else
+int cgal_render_threads = 1;
+#endif
+
+bool AbstractNode::cgal_nef_cache_lookup(const QString &cache_id, CGAL_Nef_operand &N) {
+  TraceSpan span("cgal_nef_cache_lookup");
+  QMutexLocker locker(&cgal_nef_cache_mutex);
+  CGAL_Nef_operand *cached = cgal_nef_cache.object(cache_id);
+  if (!cached)
+    return false;
+  N = *cached;
+  return true;
+}
+
+void AbstractNode::cgal_nef_cache_insert(const QString &cache_id, const CGAL_Nef_operand &N) {
+  // Cached results are read by the render workers, the compile worker and the
+  // GUI thread alike
+  cgal_nef_make_exact(N.N);
+  QMutexLocker locker(&cgal_nef_cache_mutex);
+  cgal_nef_cache.insert(cache_id, new CGAL_Nef_operand(N), N.N.number_of_vertices());
+}
+
+bool progress_in_gui_thread() {
+  QCoreApplication *app = QCoreApplication::instance();
+  return app && QThread::currentThread() == app->thread();
+}
+
+static CGAL_Nef_operand render_cgal_nef_child(ProgressJob *job, const AbstractNode *node) {
+  ProgressJobScope scope(job);
+  return node->render_cgal_nef_polyhedron();
+}
+
+QList<CGAL_Nef_operand> AbstractNode::render_cgal_nef_children() const {
+  QList<const AbstractNode*> todo;
+  foreach(AbstractNode *v, children) {
+    if (!v->modinst->tag_background)
+      todo.append(v);
   }
 
-  CGAL_Nef_polyhedron N;
+  QList<CGAL_Nef_operand> results;
+  if (cgal_render_threads <= 1 || todo.size() < 2) {
+    foreach(const AbstractNode *v, todo) {
+      if (progress_cancelled())
+        break;
+      results.append(v->render_cgal_nef_polyhedron());
+    }
+    return results;
+  }
+
+  // Sibling subtrees are independent until their results are combined. So all
+  // but the first one are handed to the thread pool while this thread renders
+  // the first one itself. The dump caches (and thus the cache ids) of the whole
+  // subtree have already been created by our own mk_cache_id() call, so the
+  // workers never write to shared node data.
+  QList< QFuture<CGAL_Nef_operand> > futures;
+  for (int i = 1; i < todo.size(); i++)
+    futures.append(QtConcurrent::run(render_cgal_nef_child, progress_job_current(), todo[i]));
+
+  results.append(todo[0]->render_cgal_nef_polyhedron());
 
+  for (int i = 0; i < futures.size(); i++)
+    results.append(progress_wait(futures[i]));
+  return results;
+}
+
+int AbstractNode::cgal_cost_estimate() const {
+  // Rough size of the CGAL result in vertices, used to plan the evaluation
+  // order before anything is rendered. A cached result gives the exact number.
+  // Only the node itself is looked up: creating the cache ids of every level
+  // of the subtree would cost O(n * depth).
+  CGAL_Nef_operand N;
+  if (cgal_nef_cache_lookup(mk_cache_id(), N))
+    return N.N.number_of_vertices();
+  return cgal_cost_subtree();
+}
+
+int AbstractNode::cgal_cost_subtree() const {
+  int cost = 0;
   foreach(AbstractNode *v, children) {
-    if (v->modinst->tag_background)
-      continue;
-    N += v->render_cgal_nef_polyhedron();
+    if (!v->modinst->tag_background)
+      cost += v->cgal_cost_subtree();
+  }
+  return cost;
+}
+
+CGAL_Nef_operand AbstractNode::render_cgal_nef_polyhedron() const {
+  TraceSpan span("render_cgal_nef_polyhedron", this);
+  QString cache_id = mk_cache_id();
+  CGAL_Nef_operand N;
+  if (cgal_nef_cache_lookup(cache_id, N)) {
+    profile_cache_hit(this);
+    progress_report();
+    return N;
   }
 
-  cgal_nef_cache.insert(cache_id, new CGAL_Nef_polyhedron(N), N.number_of_vertices());
+  QList<CGAL_Nef_operand> child_N = render_cgal_nef_children();
+  QElapsedTimer timer;
+  timer.start();
+  N = cgal_nef_reduce(child_N, CSGTerm::TYPE_UNION);
+  if (progress_cancelled())
+    return N;
+  profile_node(this, timer.nsecsElapsed(), cgal_nef_vertices(child_N), N.N.number_of_vertices());
+
+  cgal_nef_cache_insert(cache_id, N);
   progress_report();
   return N;
 }
@@ -249,6 +365,7 @@ CSGTerm *AbstractNode::render_csg_term(double m[16], QVector<CSGTerm*> *highligh
       t1 = new CSGTerm(CSGTerm::TYPE_UNION, t1, t2);
     }
   }
+  t1 = render_csg_term_autorender(t1, m);
   if (t1 && modinst->tag_highlight && highlights)
     highlights->append(t1->link());
   if (t1 && modinst->tag_background && background) {
@@ -272,6 +389,9 @@ int progress_report_count;
 void (*progress_report_f)(const class AbstractNode*, void*, int);
 void *progress_report_vp;
 
+static int progress_report_last;
+static QAtomicInt progress_report_deferred;
+
 void AbstractNode::progress_prepare() {
   foreach(AbstractNode *v, children)
   v->progress_prepare();
@@ -279,20 +399,93 @@ void AbstractNode::progress_prepare() {
 }
 
 void AbstractNode::progress_report() const {
-  if (progress_report_f)
-    progress_report_f(this, progress_report_vp, progress_mark);
+  if (!progress_report_f)
+    return;
+
+  // The progress callback drives GUI widgets. Marks reported by worker threads
+  // are only recorded here and forwarded later by progress_report_flush().
+  if (!progress_in_gui_thread()) {
+    int old = progress_report_deferred.load();
+    while (old < progress_mark && !progress_report_deferred.testAndSetOrdered(old, progress_mark))
+      old = progress_report_deferred.load();
+    return;
+  }
+
+  // Siblings finish out of order, so only ever move the mark forward.
+  int mark = qMax(progress_mark, progress_report_deferred.fetchAndStoreOrdered(0));
+  progress_report_last = qMax(progress_report_last, mark);
+  progress_report_f(this, progress_report_vp, progress_report_last);
 }
 
 void progress_report_prep(AbstractNode *root, void (*f)(const class AbstractNode *node, void *vp, int mark), void *vp) {
   progress_report_count = 0;
+  progress_report_last = 0;
+  progress_report_deferred.store(0);
   progress_report_f = f;
   progress_report_vp = vp;
   root->progress_prepare();
 }
 
+// QThreadStorage would delete a stored pointer when the thread exits
+struct ProgressJobRef {
+  ProgressJob *job;
+
+  ProgressJobRef() : job(NULL) {
+  }
+};
+
+static QThreadStorage<ProgressJobRef> progress_job_ref;
+
+ProgressJob::ProgressJob() {
+  parent = progress_job_current();
+}
+
+// Requests that the job stops. Every node checks this before it starts any
+// work and returns without caching an incomplete result, while all subtrees
+// finished so far stay in the caches.
+void ProgressJob::cancel() {
+  cancel_flag.store(1);
+}
+
+bool ProgressJob::cancelled() const {
+  for (const ProgressJob *job = this; job; job = job->parent) {
+    if (job->cancel_flag.load() != 0)
+      return true;
+  }
+  return false;
+}
+
+ProgressJobScope::ProgressJobScope(ProgressJob *job) {
+  old = progress_job_ref.localData().job;
+  progress_job_ref.localData().job = job;
+}
+
+ProgressJobScope::~ProgressJobScope() {
+  progress_job_ref.localData().job = old;
+}
+
+ProgressJob *progress_job_current() {
+  return progress_job_ref.localData().job;
+}
+
+// Work outside of any job (e.g. the headless modes) is never cancelled
+bool progress_cancelled() {
+  ProgressJob *job = progress_job_current();
+  return job && job->cancelled();
+}
+
+void progress_report_flush() {
+  int mark = progress_report_deferred.fetchAndStoreOrdered(0);
+  if (mark <= progress_report_last || !progress_report_f)
+    return;
+  progress_report_last = mark;
+  progress_report_f(NULL, progress_report_vp, mark);
+}
+
 void progress_report_fin() {
   progress_report_count = 0;
+  progress_report_last = 0;
+  progress_report_deferred.store(0);
   progress_report_f = NULL;
   progress_report_vp = NULL;
 }
-
@@ -30,6 +30,24 @@ int main(int argc, char **argv) {
   initialize_builtin_functions();
   initialize_builtin_modules();
 
+  if (argc > 1 && (!strcmp(argv[1], "--benchmark") || !strcmp(argv[1], "--microbench") ||
+          !strcmp(argv[1], "--scaling") || !strcmp(argv[1], "--raytrace") ||
+          !strcmp(argv[1], "--rasterize"))) {
+    if (!strcmp(argv[1], "--benchmark"))
+      rc = benchmark_main(argc, argv);
+    else if (!strcmp(argv[1], "--microbench"))
+      rc = microbench_main(argc, argv);
+    else if (!strcmp(argv[1], "--raytrace"))
+      rc = raytrace_main(argc, argv);
+    else if (!strcmp(argv[1], "--rasterize"))
+      rc = rasterize_main(argc, argv);
+    else
+      rc = scaling_main(argc, argv);
+    destroy_builtin_functions();
+    destroy_builtin_modules();
+    return rc;
+  }
+
   QApplication a(argc, argv);
   MainWindow *m;
 
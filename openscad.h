@@ -36,6 +36,12 @@
 #include <QGLWidget>
 #include <QPointer>
 #include <QTimer>
+#include <QMutex>
+#include <QThread>
+#include <QAtomicInt>
+#include <QFuture>
+#include <QFutureWatcher>
+#include <QElapsedTimer>
 
 #include <stdio.h>
 #include <errno.h>
@@ -194,6 +200,90 @@ public:
   }
 };
 
+class BoundingBox {
+public:
+  double min[3], max[3];
+
+  BoundingBox() {
+    for (int i = 0; i < 3; i++) {
+      min[i] = +HUGE_VAL;
+      max[i] = -HUGE_VAL;
+    }
+  }
+
+  bool is_empty() const {
+    return min[0] > max[0] || min[1] > max[1] || min[2] > max[2];
+  }
+
+  void extend(double x, double y, double z) {
+    double p[3] = {x, y, z};
+    for (int i = 0; i < 3; i++) {
+      min[i] = fmin(min[i], p[i]);
+      max[i] = fmax(max[i], p[i]);
+    }
+  }
+
+  void extend(const BoundingBox &bb) {
+    if (bb.is_empty())
+      return;
+    extend(bb.min[0], bb.min[1], bb.min[2]);
+    extend(bb.max[0], bb.max[1], bb.max[2]);
+  }
+
+  // Boxes that only touch (or are closer than eps) count as intersecting.
+  bool intersects(const BoundingBox &bb, double eps = 1e-6) const {
+    if (is_empty() || bb.is_empty())
+      return false;
+    for (int i = 0; i < 3; i++) {
+      if (max[i] + eps < bb.min[i] || bb.max[i] + eps < min[i])
+        return false;
+    }
+    return true;
+  }
+
+  // Uses the same eps as intersects(), so boxes that count as intersecting
+  // there never give an empty intersection. Where they only touch, the result
+  // is flat on that axis.
+  BoundingBox intersection(const BoundingBox &bb, double eps = 1e-6) const {
+    BoundingBox r;
+    if (!intersects(bb, eps))
+      return r;
+    for (int i = 0; i < 3; i++) {
+      r.min[i] = fmax(min[i], bb.min[i]);
+      r.max[i] = fmin(max[i], bb.max[i]);
+      if (r.min[i] > r.max[i])
+        r.min[i] = r.max[i] = (r.min[i] + r.max[i]) / 2;
+    }
+    return r;
+  }
+
+  // The Nef transformation and the GL view both divide by the homogeneous w of
+  // the bottom row, so a constant w (m[15]) is divided out here as well. With a
+  // projective bottom row the images of the corners bound nothing (w may change
+  // sign inside the box), so the result then covers the whole space.
+  BoundingBox transformed(const double m[16]) const {
+    BoundingBox r;
+    if (is_empty())
+      return r;
+    if (m[3] != 0 || m[7] != 0 || m[11] != 0 || m[15] == 0) {
+      for (int i = 0; i < 3; i++) {
+        r.min[i] = -HUGE_VAL;
+        r.max[i] = +HUGE_VAL;
+      }
+      return r;
+    }
+    for (int i = 0; i < 8; i++) {
+      double x = (i & 1) ? max[0] : min[0];
+      double y = (i & 2) ? max[1] : min[1];
+      double z = (i & 4) ? max[2] : min[2];
+      r.extend((m[0] * x + m[4] * y + m[ 8] * z + m[12]) / m[15],
+              (m[1] * x + m[5] * y + m[ 9] * z + m[13]) / m[15],
+              (m[2] * x + m[6] * y + m[10] * z + m[14]) / m[15]);
+    }
+    return r;
+  }
+};
+
 class Value {
 public:
 
@@ -342,13 +432,14 @@ public:
   QVector<Expression*> argexpr;
   QVector<Value> argvalues;
   QVector<ModuleInstanciation*> children;
+  int line;
 
   bool tag_root;
   bool tag_highlight;
   bool tag_background;
   const Context *ctx;
 
-  ModuleInstanciation() : tag_root(false), tag_highlight(false), tag_background(false), ctx(NULL) {
+  ModuleInstanciation() : line(0), tag_root(false), tag_highlight(false), tag_background(false), ctx(NULL) {
   }
   ~ModuleInstanciation();
 
@@ -473,18 +564,55 @@ public:
   Point *p(double x, double y);
 };
 
+// Long running work can be cancelled per job: a background compile or a CGAL
+// render with progress dialog each have a flag of their own. A job started
+// while another one is current on the same thread is nested in it, and
+// cancelling a job also cancels all jobs nested in it.
+class ProgressJob {
+public:
+  ProgressJob *parent;
+  QAtomicInt cancel_flag;
+
+  ProgressJob();
+  void cancel();
+  bool cancelled() const;
+};
+
+// Makes a job the current job of the calling thread for the lifetime of the
+// scope. Work handed to the thread pool has to take the job along.
+class ProgressJobScope {
+  ProgressJob *old;
+public:
+  ProgressJobScope(ProgressJob *job);
+  ~ProgressJobScope();
+};
+
+ProgressJob *progress_job_current();
+
 // The CGAL template magic slows down the compilation process by a factor of 5.
 // So we only include the declaration of AbstractNode where it is needed...
 #ifdef INCLUDE_ABSTRACT_NODE_DETAILS
 
 
+#ifdef ENABLE_CGAL_LAZY_KERNEL
+// Predicates are evaluated with interval arithmetic first and only fall back
+// to exact numbers when the result is ambiguous. Constructions are stored as
+// lazy expression DAGs and evaluated exactly on demand.
+#include <CGAL/Exact_predicates_exact_constructions_kernel.h>
+#else
 #include <CGAL/Gmpq.h>
 #include <CGAL/Cartesian.h>
+#endif
 #include <CGAL/Polyhedron_3.h>
 #include <CGAL/Nef_polyhedron_3.h>
 #include <CGAL/IO/Polyhedron_iostream.h>
 
+#ifdef ENABLE_CGAL_LAZY_KERNEL
+typedef CGAL::Exact_predicates_exact_constructions_kernel CGAL_Kernel;
+#else
+// Plain GMP rationals, every operation is exact. Kept as reference kernel.
 typedef CGAL::Cartesian<CGAL::Gmpq> CGAL_Kernel;
+#endif
 typedef CGAL::Polyhedron_3<CGAL_Kernel> CGAL_Polyhedron;
 typedef CGAL_Polyhedron::HalfedgeDS CGAL_HDS;
 typedef CGAL::Polyhedron_incremental_builder_3<CGAL_HDS> CGAL_Polybuilder;
@@ -494,7 +622,59 @@ typedef CGAL_Nef_polyhedron::Vector_3 CGAL_Vector;
 typedef CGAL_Nef_polyhedron::Plane_3 CGAL_Plane;
 typedef CGAL_Nef_polyhedron::Point_3 CGAL_Point;
 
+BoundingBox cgal_nef_bbox(const CGAL_Nef_polyhedron &N);
+// Evaluates the lazy values of N before it is shared between threads
+void cgal_nef_make_exact(const CGAL_Nef_polyhedron &N);
+
+// A Nef polyhedron together with a conservative bounding box. Rendered nodes
+// return (and cache) their box with the result, and the boxes of combined
+// results are derived from the operands, so vertices are scanned only where
+// there is nothing to derive the box from.
+struct CGAL_Nef_operand {
+  CGAL_Nef_polyhedron N;
+  BoundingBox bb;
+
+  CGAL_Nef_operand() {
+  }
+
+  CGAL_Nef_operand(const CGAL_Nef_polyhedron &N) : N(N), bb(cgal_nef_bbox(N)) {
+  }
+
+  CGAL_Nef_operand(const CGAL_Nef_polyhedron &N, const BoundingBox &bb) : N(N), bb(bb) {
+  }
+};
+
+// The mesh engine does booleans by corefinement of closed triangle meshes.
+// Predicates are exact, but the coordinates are stored as plain doubles.
+#include <CGAL/Exact_predicates_inexact_constructions_kernel.h>
+#include <CGAL/Surface_mesh.h>
 
+typedef CGAL::Exact_predicates_inexact_constructions_kernel CGAL_Mesh_kernel;
+typedef CGAL::Surface_mesh<CGAL_Mesh_kernel::Point_3> CGAL_Mesh;
+
+
+
+// Vertex arrays for glDrawArrays(): triangles with normals (GL_N3F_V3F) and
+// edges (GL_V3F), uploaded to buffer objects if the GL has them.
+class GLBatch {
+public:
+  QVector<GLfloat> surface, edges;
+  BoundingBox bbox;
+
+  GLBatch();
+  ~GLBatch();
+
+  void upload();
+  void render_surface(const QVector<double*> *matrices = NULL) const;
+  void render_edges(const QVector<double*> *matrices = NULL) const;
+
+  static bool have_buffers;
+  static void collect_garbage();
+  static void normal_matrix(const double *m, double n[9]);
+
+private:
+  GLuint buffers[2];
+};
 
 class PolySet {
 public:
@@ -529,13 +709,35 @@ public:
   };
 
   static QCache<QString, PolySetPtr> ps_cache;
+  static QMutex ps_cache_mutex;
 
   void render_surface(colormode_e colormode, GLint *shaderinfo = NULL) const;
   void render_edges(colormode_e colormode) const;
 
+  // The triangles and edges for render_surface() and render_edges(), built
+  // on first use and rebuilt when the polygons change. Shared polysets are
+  // also prepared by the software rasterizer on worker threads, gl_mutex
+  // guards gl, gl_lods and the flags.
+  mutable GLBatch gl;
+  mutable bool gl_dirty, gl_uploaded;
+  mutable QMutex gl_mutex;
+  void gl_prepare() const;
+  void gl_prepare_locked() const;
+
+  // Decimated copies of gl for views where the polyset covers few pixels,
+  // level 0 is gl itself. Small polysets are never decimated.
+  mutable GLBatch *gl_lods[2];
+  const GLBatch *gl_lod(int level) const;
+
+  static void gl_color(colormode_e colormode, bool edges);
+  static const unsigned char *color(colormode_e colormode, bool edges);
+
+  BoundingBox bounding_box() const;
+  int number_of_vertices() const;
   CGAL_Nef_polyhedron render_cgal_nef_polyhedron() const;
+  bool render_mesh(CGAL_Mesh &M) const;
 
-  int refcount;
+  QAtomicInt refcount;
   PolySet *link();
   void unlink();
 };
@@ -571,11 +773,23 @@ public:
   double m[16];
   int refcounter;
 
+  // Conservative: contains everything the term can cover
+  BoundingBox bbox;
+
+  // Estimated size of the normal form: number of products of the term, and
+  // number of products each product x turns into in x - term. Computed from
+  // the structure only, without pruning.
+  double products, neg_products;
+  double primitives;
+
+  // Highest convexity of the primitives, used when the term is replaced
+  // by one rendered with CGAL
+  int convexity;
+
   CSGTerm(PolySet *polyset, double m[16], QString label);
   CSGTerm(type_e type, CSGTerm *left, CSGTerm *right);
 
   CSGTerm *normalize();
-  CSGTerm *normalize_tail();
 
   CSGTerm *link();
   void unlink();
@@ -589,10 +803,24 @@ public:
   QVector<CSGTerm::type_e> types;
   QVector<QString> labels;
 
+  // Thrown together view, built on first paint: entries with small
+  // polysets merged into one pre-transformed batch per color mode, the
+  // others grouped by polyset and drawn once per matrix.
+  struct GLGroup {
+    PolySet *polyset;
+    PolySet::colormode_e colormode;
+    QVector<double*> matrices;
+  };
+  QVector<GLGroup> gl_groups;
+  QVector< QPair<PolySet::colormode_e, GLBatch*> > gl_merged;
+  bool gl_prepared;
+
   CSGChain();
+  ~CSGChain();
 
   void add(PolySet *polyset, double *m, CSGTerm::type_e type, QString label);
   void import(CSGTerm *term, CSGTerm::type_e type = CSGTerm::TYPE_UNION);
+  PolySet::colormode_e colormode(int i, bool highlight, bool background) const;
   QString dump();
 };
 
@@ -609,12 +837,30 @@ public:
   static int idx_counter;
   QString dump_cache;
 
+  // Grid for snap rounding, set by render(snap = ..). Transformations and
+  // the render() node itself round their results to it.
+  double snap_grid;
+  void set_snap_grid(double grid);
+
   AbstractNode(const ModuleInstanciation *mi);
   virtual ~AbstractNode();
   virtual QString mk_cache_id() const;
-  static QCache<QString, CGAL_Nef_polyhedron> cgal_nef_cache;
-  virtual CGAL_Nef_polyhedron render_cgal_nef_polyhedron() const;
+  static QCache<QString, CGAL_Nef_operand> cgal_nef_cache;
+  static QMutex cgal_nef_cache_mutex;
+  static bool cgal_nef_cache_lookup(const QString &cache_id, CGAL_Nef_operand &N);
+  static void cgal_nef_cache_insert(const QString &cache_id, const CGAL_Nef_operand &N);
+  QList<CGAL_Nef_operand> render_cgal_nef_children() const;
+  int cgal_cost_estimate() const;
+  virtual int cgal_cost_subtree() const;
+  virtual CGAL_Nef_operand render_cgal_nef_polyhedron() const;
+  static QCache<QString, CGAL_Mesh> cgal_mesh_cache;
+  static QMutex cgal_mesh_cache_mutex;
+  static bool cgal_mesh_cache_lookup(const QString &cache_id, CGAL_Mesh &M);
+  static void cgal_mesh_cache_insert(const QString &cache_id, const CGAL_Mesh &M);
+  bool render_mesh_children(CGAL_Mesh &M, CSGTerm::type_e op) const;
+  virtual bool render_mesh(CGAL_Mesh &M) const;
   virtual CSGTerm *render_csg_term(double m[16], QVector<CSGTerm*> *highlights, QVector<CSGTerm*> *background) const;
+  CSGTerm *render_csg_term_autorender(CSGTerm *term, double m[16]) const;
   virtual QString dump(QString indent) const;
 };
 
@@ -629,7 +875,9 @@ public:
   AbstractPolyNode(const ModuleInstanciation *mi) : AbstractNode(mi) {
   };
   virtual PolySet *render_polyset(render_mode_e mode) const;
-  virtual CGAL_Nef_polyhedron render_cgal_nef_polyhedron() const;
+  virtual int cgal_cost_subtree() const;
+  virtual CGAL_Nef_operand render_cgal_nef_polyhedron() const;
+  virtual bool render_mesh(CGAL_Mesh &M) const;
   virtual CSGTerm *render_csg_term(double m[16], QVector<CSGTerm*> *highlights, QVector<CSGTerm*> *background) const;
   static CSGTerm *render_csg_term_from_ps(double m[16], QVector<CSGTerm*> *highlights, QVector<CSGTerm*> *background, PolySet *ps, const ModuleInstanciation *modinst, int idx);
 };
@@ -639,10 +887,55 @@ extern void (*progress_report_f)(const class AbstractNode*, void*, int);
 extern void *progress_report_vp;
 
 void progress_report_prep(AbstractNode *root, void (*f)(const class AbstractNode *node, void *vp, int mark), void *vp);
+void progress_report_flush();
 void progress_report_fin();
+bool progress_in_gui_thread();
+bool progress_cancelled();
+bool progress_run(AbstractNode *root, void (*f)(void *vp), void *vp);
+
+// Waits for a result from the thread pool. The GUI thread keeps forwarding
+// the progress reports of the workers while it is waiting.
+template <typename T>
+T progress_wait(const QFuture<T> &future) {
+  if (progress_in_gui_thread()) {
+    while (!future.isFinished()) {
+      progress_report_flush();
+      QThread::msleep(10);
+    }
+  }
+  return future.result();
+}
+
+extern int cgal_render_threads;
+extern double csg_autorender_limit;
+
+CGAL_Nef_operand cgal_nef_reduce(QList<CGAL_Nef_operand> list, CSGTerm::type_e op);
+
+extern bool profile_enabled;
+void profile_reset();
+void profile_cache_hit(const AbstractNode *node);
+void profile_node(const AbstractNode *node, qint64 nsecs, int vertices_in, int vertices_out);
+int cgal_nef_vertices(const QList<CGAL_Nef_operand> &list);
+void profile_totals(int &cache_hits, int &cache_misses);
+QString profile_report(int max_nodes);
+QByteArray profile_json();
+
+extern QAtomicInt cgal_snap_moved;
+bool cgal_nef_snap(CGAL_Nef_operand &N, double grid);
+
+bool cgal_mesh_combine(CGAL_Mesh &M, const CGAL_Mesh &other, CSGTerm::type_e op);
+void cgal_mesh_transform(CGAL_Mesh &M, const double m[16]);
+bool cgal_mesh_snap(CGAL_Mesh &M, double grid);
+PolySet *cgal_mesh_to_polyset(const CGAL_Mesh &M);
+void nef_to_polyset(PolySet *ps, const CGAL_Nef_polyhedron &N);
+CGAL_Nef_polyhedron cgal_mesh_to_nef(const CGAL_Mesh &M);
 
 void dxf_tesselate(PolySet *ps, DxfData *dxf, double rot, bool up, double h);
 
+// CPU ray casting of the raw CSG tree, see raytrace.cc. Angles and distance
+// as in GLView, a distance of 0 fits the design into the image.
+QImage raytrace_term(CSGTerm *term, int width, int height, double rot_x, double rot_z, double distance, int samples);
+
 #else
 
 // Needed for Mainwin::root_N
@@ -667,6 +960,14 @@ public:
 
   GLView(QWidget *parent = NULL);
 
+  // The projection and modelview of the current paint combined, for culling
+  double view_clip[16];
+  double screen_size(const BoundingBox &bb, const double *m = NULL) const;
+
+  bool dragging() const {
+    return mouse_drag_active;
+  }
+
 protected:
   bool mouse_drag_active;
   int last_mouse_x;
@@ -682,7 +983,32 @@ protected:
   void paintGL();
 };
 
-class MainWindow : public QMainWindow {
+// Everything a compile produces. Compiles build a new CompiledDesign on a
+// worker thread, which then replaces the one of the MainWindow at once.
+class CompiledDesign {
+public:
+  AbstractModule *root_module;
+  // The root node refers to this instantiation (profiling, tracing), so it
+  // has to live as long as the node tree.
+  ModuleInstanciation *root_inst;
+  AbstractNode *absolute_root_node;
+  CSGTerm *root_raw_term;
+  CSGTerm *root_norm_term;
+  CSGChain *root_chain;
+
+  QVector<CSGTerm*> highlight_terms;
+  CSGChain *highlights_chain;
+  QVector<CSGTerm*> background_terms;
+  CSGChain *background_chain;
+  AbstractNode *root_node;
+  bool enableOpenCSG;
+
+  CompiledDesign();
+  ~CompiledDesign();
+  void swap(CompiledDesign &other);
+};
+
+class MainWindow : public QMainWindow, public CompiledDesign {
   Q_OBJECT
 
 public:
@@ -698,19 +1024,14 @@ public:
   QLineEdit *e_tval, *e_fps, *e_fsteps;
 
   Context root_ctx;
-  AbstractModule *root_module;
-  AbstractNode *absolute_root_node;
-  CSGTerm *root_raw_term;
-  CSGTerm *root_norm_term;
-  CSGChain *root_chain;
   CGAL_Nef_polyhedron *root_N;
 
-  QVector<CSGTerm*> highlight_terms;
-  CSGChain *highlights_chain;
-  QVector<CSGTerm*> background_terms;
-  CSGChain *background_chain;
-  AbstractNode *root_node;
-  bool enableOpenCSG;
+  QTimer *compile_timer;
+  QFutureWatcher<CompiledDesign*> *compile_watcher;
+  ProgressJob *compile_job;
+  bool compile_running;
+  bool compile_pending;
+  int compile_blocked;
 
   MainWindow(const char *filename = 0);
   ~MainWindow();
@@ -718,12 +1039,19 @@ public:
 private slots:
   void updatedFps();
   void updateTVal();
+  void updatedTVal();
 
 private:
   void load();
   void maybe_change_dir();
-  void find_root_tag(AbstractNode *n);
   void compile(bool procevents);
+  void compile_abort();
+  void render_cgal();
+
+private slots:
+  void compileDebounced();
+  void compileAsync(bool supersede = true);
+  void compileFinished();
 
 private slots:
   void actionNew();
@@ -747,10 +1075,20 @@ private slots:
   void actionDisplayCSGProducts();
   void actionExportSTL();
   void actionExportOFF();
+  void actionExportImage();
+  void actionProfile();
+  void actionExportProfile();
+  void actionTrace();
+  void actionExportTrace();
 
 public:
+  QAction *actDesignProfile;
+  QAction *actDesignTrace;
   QAction *actViewModeCGALSurface;
   QAction *actViewModeCGALGrid;
+#ifdef ENABLE_OPENCSG
+  QAction *actViewModeOpenCSG;
+#endif
   QAction *actViewModeThrownTogether;
   QAction *actViewModeShowEdges;
   QAction *actViewModeAnimate;
@@ -759,6 +1097,9 @@ public:
 private slots:
   void viewModeCGALSurface();
   void viewModeCGALGrid();
+#ifdef ENABLE_OPENCSG
+  void viewModeOpenCSG();
+#endif
   void viewModeThrownTogether();
   void viewModeShowEdges();
   void viewModeAnimate();
@@ -766,10 +1107,63 @@ private slots:
 
 extern AbstractModule *parse(const char *text, int debug);
 extern int get_fragments_from_r(double r, double fn, double fs, double fa);
+extern void init_root_ctx(Context *ctx, double tval);
+extern void normalize_term(CSGTerm *&term);
+extern CompiledDesign *compile_design(QByteArray source, double tval, bool procevents);
+extern CompiledDesign *compile_file(const QString &filename);
+extern void headless_run(void (*f)(void *vp), void *vp);
+
+// Command line of the headless image modes (--raytrace, --rasterize): the
+// input files, "-o file" for a single image, "-d dir" for the output
+// directory (default: next to each input) and "-s WIDTHxHEIGHT".
+struct HeadlessImageArgs {
+  QStringList files;
+  QString output_file, output_dir;
+  int width, height;
+
+  HeadlessImageArgs(int size);
+  // Takes argv[i] (and its value), false for unknown or invalid options
+  bool parse(int argc, char **argv, int &i);
+  bool valid(int images_per_file) const;
+  QString output(const QString &file, const QString &suffix) const;
+};
+
+extern int benchmark_main(int argc, char **argv);
+extern int microbench_main(int argc, char **argv);
+extern int scaling_main(int argc, char **argv);
+extern int raytrace_main(int argc, char **argv);
+extern int rasterize_main(int argc, char **argv);
+
+extern bool trace_enabled;
+
+// Records the lifetime of the object as one span of the trace. Does nothing
+// (but checking a flag) while tracing is disabled.
+class TraceSpan {
+public:
+  TraceSpan(const char *name, const AbstractNode *node = NULL) : name(NULL) {
+    if (trace_enabled)
+      begin(name, node);
+  }
+  ~TraceSpan() {
+    if (name)
+      end();
+  }
+
+private:
+  const char *name;
+  QString detail;
+  qint64 start;
+
+  void begin(const char *name, const AbstractNode *node);
+  void end();
+};
+
+void trace_reset();
+QByteArray trace_json();
 
 extern QPointer<MainWindow> current_win;
 
-#define PRINT(_msg) do { if (current_win.isNull()) fprintf(stderr, "%s\n", QString(_msg).toLatin1().data()); else current_win->console->append(_msg); } while (0)
+#define PRINT(_msg) do { if (current_win.isNull()) fprintf(stderr, "%s\n", QString(_msg).toLatin1().data()); else if (QThread::currentThread() != current_win->thread()) QMetaObject::invokeMethod(current_win->console, "append", Qt::QueuedConnection, Q_ARG(QString, QString(_msg))); else current_win->console->append(_msg); } while (0)
 #define PRINTF(_fmt, ...) do { QString _m; _m.sprintf(_fmt, ##__VA_ARGS__); PRINT(_m); } while (0)
 #define PRINTA(_fmt, ...) do { QString _m = QString(_fmt).arg(__VA_ARGS__); PRINT(_m); } while (0)
 
@@ -5,6 +5,10 @@ TEMPLATE = app
 DEFINES += "ENABLE_CGAL=1"
 LIBS += -lCGAL -lmpfr -lgmp -lglut -lGLU -lm
 
+# Use the filtered lazy-exact CGAL kernel. Build with "qmake CONFIG+=cgal_gmpq"
+# to get the plain Cartesian<Gmpq> kernel for reference comparisons.
+!cgal_gmpq:DEFINES += "ENABLE_CGAL_LAZY_KERNEL=1"
+
 DEFINES += "ENABLE_OPENCSG=1"
 LIBS += -lopencsg -lGLEW -lglut -lGLU -lm
 
@@ -14,14 +18,16 @@ YACCSOURCES += parser.y
 HEADERS += openscad.h
 SOURCES += openscad.cc mainwin.cc glview.cc
 SOURCES += value.cc expr.cc func.cc module.cc context.cc
-SOURCES += csgterm.cc polyset.cc csgops.cc transform.cc
+SOURCES += csgterm.cc polyset.cc csgops.cc transform.cc meshops.cc
 SOURCES += primitives.cc surface.cc control.cc render.cc
 SOURCES += dxfdata.cc dxftess.cc dxfdim.cc
 SOURCES += dxflinextrude.cc dxfrotextrude.cc
+SOURCES += profile.cc trace.cc bench.cc microbench.cc
+SOURCES += raytrace.cc rasterizer.cc headless.cc
 
 QMAKE_CXXFLAGS += -O0
 
-QT += opengl
+QT += opengl concurrent
 
 target.path = /usr/local/bin/
 INSTALLS += target
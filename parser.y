@@ -181,6 +181,7 @@ single_module_instantciation:
 	TOK_ID '(' arguments_call ')' {
 		$$ = new ModuleInstanciation();
 		$$->modname = QString($1);
+		$$->line = lexerget_lineno();
 		$$->argnames = $3->argnames;
 		$$->argexpr = $3->argexpr;
 		free($1);
@@ -22,42 +22,165 @@
 
 #include "openscad.h"
 
+#include <QSet>
+
 QCache<QString, PolySetPtr> PolySet::ps_cache(100);
+QMutex PolySet::ps_cache_mutex;
+
+bool GLBatch::have_buffers;
+
+// Batches are also deleted on the compile and render worker threads, where
+// there is no current GL context. Their buffers are deleted by the next paint.
+static QMutex gl_garbage_mutex;
+static QVector<GLuint> gl_garbage;
+
+GLBatch::GLBatch() {
+  buffers[0] = buffers[1] = 0;
+}
+
+GLBatch::~GLBatch() {
+  if (buffers[0] || buffers[1]) {
+    QMutexLocker locker(&gl_garbage_mutex);
+    for (int i = 0; i < 2; i++) {
+      if (buffers[i])
+        gl_garbage.append(buffers[i]);
+    }
+  }
+}
+
+void GLBatch::collect_garbage() {
+  QMutexLocker locker(&gl_garbage_mutex);
+  if (gl_garbage.isEmpty())
+    return;
+  glDeleteBuffers(gl_garbage.size(), gl_garbage.data());
+  gl_garbage.clear();
+}
+
+void GLBatch::upload() {
+  if (!have_buffers)
+    return;
+  if (!buffers[0])
+    glGenBuffers(2, buffers);
+  glBindBuffer(GL_ARRAY_BUFFER, buffers[0]);
+  glBufferData(GL_ARRAY_BUFFER, surface.size() * sizeof(GLfloat), surface.constData(), GL_STATIC_DRAW);
+  glBindBuffer(GL_ARRAY_BUFFER, buffers[1]);
+  glBufferData(GL_ARRAY_BUFFER, edges.size() * sizeof(GLfloat), edges.constData(), GL_STATIC_DRAW);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// Draws vertex data from the buffer object if there is one, or from the
+// client side array otherwise (plain OpenGL 1.1). The arrays are set up
+// once and drawn once per matrix.
+static void gl_draw_arrays(GLenum mode, GLenum format, int stride, GLuint buffer, const QVector<GLfloat> &data, const QVector<double*> *matrices) {
+  if (data.isEmpty() || (matrices && matrices->isEmpty()))
+    return;
+  if (buffer) {
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    glInterleavedArrays(format, 0, NULL);
+  } else {
+    glInterleavedArrays(format, 0, data.constData());
+  }
+  if (matrices) {
+    for (int i = 0; i < matrices->size(); i++) {
+      glPushMatrix();
+      glMultMatrixd(matrices->at(i));
+      glDrawArrays(mode, 0, data.size() / stride);
+      glPopMatrix();
+    }
+  } else {
+    glDrawArrays(mode, 0, data.size() / stride);
+  }
+  glDisableClientState(GL_NORMAL_ARRAY);
+  glDisableClientState(GL_VERTEX_ARRAY);
+  if (buffer)
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void GLBatch::render_surface(const QVector<double*> *matrices) const {
+  gl_draw_arrays(GL_TRIANGLES, GL_N3F_V3F, 6, buffers[0], surface, matrices);
+}
+
+void GLBatch::render_edges(const QVector<double*> *matrices) const {
+  gl_draw_arrays(GL_LINES, GL_V3F, 3, buffers[1], edges, matrices);
+}
+
+// The 3x3 matrix (column major, like m) that transforms normals along with
+// m: the cofactor matrix, i.e. the inverse transpose up to the determinant,
+// so that normals stay perpendicular under non-uniform scaling and shearing.
+// For mirroring matrices the sign is flipped to keep them pointing outwards.
+void GLBatch::normal_matrix(const double *m, double n[9]) {
+  double c[9] = {
+    m[5]*m[10] - m[6]*m[9], m[6]*m[8] - m[4]*m[10], m[4]*m[9] - m[5]*m[8],
+    m[9]*m[2] - m[10]*m[1], m[10]*m[0] - m[8]*m[2], m[8]*m[1] - m[9]*m[0],
+    m[1]*m[6] - m[2]*m[5], m[2]*m[4] - m[0]*m[6], m[0]*m[5] - m[1]*m[4]
+  };
+  double det = m[0]*c[0] + m[4]*c[1] + m[8]*c[2];
+  double sign = det < 0 ? -1 : 1;
+  for (int i = 0; i < 9; i++)
+    n[i] = sign * c[i];
+}
 
 PolySet::PolySet() {
   convexity = 1;
-  refcount = 1;
+  refcount.store(1);
+  gl_dirty = true;
+  gl_uploaded = false;
+  gl_lods[0] = gl_lods[1] = NULL;
 }
 
 PolySet::~PolySet() {
-  assert(refcount == 0);
+  assert(refcount.load() == 0);
+  delete gl_lods[0];
+  delete gl_lods[1];
 }
 
 PolySet* PolySet::link() {
-  refcount++;
+  refcount.ref();
   return this;
 }
 
 void PolySet::unlink() {
-  if (--refcount == 0)
+  if (!refcount.deref())
     delete this;
 }
 
 void PolySet::append_poly() {
   polygons.append(Polygon());
+  gl_dirty = true;
 }
 
 void PolySet::append_vertex(double x, double y, double z) {
   grid.align(x, y, z);
   polygons.last().append(Point(x, y, z));
+  gl_dirty = true;
 }
 
 void PolySet::insert_vertex(double x, double y, double z) {
   grid.align(x, y, z);
   polygons.last().insert(0, Point(x, y, z));
+  gl_dirty = true;
+}
+
+// Every vertex is aligned to the grid when it is appended, so each cell of the
+// grid is one distinct vertex. The Nef conversion merges vertices on the same
+// grid, so this is also the vertex count of the Nef polyhedron.
+int PolySet::number_of_vertices() const {
+  return grid.db.size();
+}
+
+BoundingBox PolySet::bounding_box() const {
+  BoundingBox bb;
+  for (int i = 0; i < polygons.size(); i++) {
+    const Polygon *poly = &polygons[i];
+    for (int j = 0; j < poly->size(); j++) {
+      const Point *p = &poly->at(j);
+      bb.extend(p->x, p->y, p->z);
+    }
+  }
+  return bb;
 }
 
-static void gl_draw_triangle(GLint *shaderinfo, const PolySet::Point *p0, const PolySet::Point *p1, const PolySet::Point *p2, bool e0, bool e1, bool e2) {
+static void gl_add_triangle(QVector<GLfloat> &data, const PolySet::Point *p0, const PolySet::Point *p1, const PolySet::Point *p2) {
   double ax = p1->x - p0->x, bx = p1->x - p2->x;
   double ay = p1->y - p0->y, by = p1->y - p2->y;
   double az = p1->z - p0->z, bz = p1->z - p2->z;
@@ -65,35 +188,47 @@ static void gl_draw_triangle(GLint *shaderinfo, const PolySet::Point *p0, const
   double ny = az * bx - ax*bz;
   double nz = ax * by - ay*bx;
   double nl = sqrt(nx * nx + ny * ny + nz * nz);
-  glNormal3d(nx / nl, ny / nl, nz / nl);
-  {
-    glVertex3d(p0->x, p0->y, p0->z);
-    glVertex3d(p1->x, p1->y, p1->z);
-    glVertex3d(p2->x, p2->y, p2->z);
+  if (nl == 0)
+    nx = ny = 0, nz = nl = 1;
+  const PolySet::Point *p[3] = { p0, p1, p2 };
+  for (int i = 0; i < 3; i++) {
+    data << nx / nl << ny / nl << nz / nl;
+    data << p[i]->x << p[i]->y << p[i]->z;
   }
 }
 
-void PolySet::render_surface(colormode_e colormode, GLint *shaderinfo) const {
-  if (colormode == COLORMODE_MATERIAL) {
-    glColor3ub(249, 215, 44);
-  }
-  if (colormode == COLORMODE_CUTOUT) {
-    glColor3ub(157, 203, 81);
-  }
-  if (colormode == COLORMODE_HIGHLIGHT) {
-    glColor4ub(255, 157, 81, 128);
+void PolySet::gl_prepare() const {
+  QMutexLocker locker(&gl_mutex);
+  gl_prepare_locked();
+}
+
+void PolySet::gl_prepare_locked() const {
+  // Buffer objects can only be created in the GUI thread, which has the GL
+  // context. Arrays built on other threads are uploaded by its next paint.
+  if (!gl_dirty) {
+    if (!gl_uploaded && progress_in_gui_thread()) {
+      gl.upload();
+      gl_uploaded = true;
+    }
+    return;
   }
-  if (colormode == COLORMODE_BACKGROUND) {
-    glColor4ub(180, 180, 180, 128);
+  gl_dirty = false;
+
+  for (int i = 0; i < 2; i++) {
+    delete gl_lods[i];
+    gl_lods[i] = NULL;
   }
+
+  gl.bbox = bounding_box();
+  gl.surface.clear();
+  gl.edges.clear();
   for (int i = 0; i < polygons.size(); i++) {
     const Polygon *poly = &polygons[i];
-    glBegin(GL_TRIANGLES);
     if (poly->size() == 3) {
-      gl_draw_triangle(shaderinfo, &poly->at(0), &poly->at(1), &poly->at(2), true, true, true);
+      gl_add_triangle(gl.surface, &poly->at(0), &poly->at(1), &poly->at(2));
     } else if (poly->size() == 4) {
-      gl_draw_triangle(shaderinfo, &poly->at(0), &poly->at(1), &poly->at(3), true, false, true);
-      gl_draw_triangle(shaderinfo, &poly->at(2), &poly->at(3), &poly->at(1), true, false, true);
+      gl_add_triangle(gl.surface, &poly->at(0), &poly->at(1), &poly->at(3));
+      gl_add_triangle(gl.surface, &poly->at(2), &poly->at(3), &poly->at(1));
     } else {
       Point center;
       for (int j = 0; j < poly->size(); j++) {
@@ -105,31 +240,145 @@ void PolySet::render_surface(colormode_e colormode, GLint *shaderinfo) const {
       center.y /= poly->size();
       center.z /= poly->size();
       for (int j = 1; j <= poly->size(); j++) {
-        gl_draw_triangle(shaderinfo, &center, &poly->at(j - 1), &poly->at(j % poly->size()), false, true, false);
+        gl_add_triangle(gl.surface, &center, &poly->at(j - 1), &poly->at(j % poly->size()));
       }
     }
-    glEnd();
+    for (int j = 1; j < poly->size(); j++) {
+      const Point *p1 = &poly->at(j - 1), *p2 = &poly->at(j);
+      gl.edges << p1->x << p1->y << p1->z << p2->x << p2->y << p2->z;
+    }
   }
+
+  gl_uploaded = progress_in_gui_thread();
+  if (gl_uploaded)
+    gl.upload();
 }
 
-void PolySet::render_edges(colormode_e colormode) const {
-  if (colormode == COLORMODE_MATERIAL)
-    glColor3ub(255, 236, 94);
-  if (colormode == COLORMODE_CUTOUT)
-    glColor3ub(171, 216, 86);
-  if (colormode == COLORMODE_HIGHLIGHT)
-    glColor4ub(255, 171, 86, 128);
-  if (colormode == COLORMODE_BACKGROUND)
-    glColor4ub(150, 150, 150, 128);
-  for (int i = 0; i < polygons.size(); i++) {
-    const Polygon *poly = &polygons[i];
-    glBegin(GL_LINE_STRIP);
-    for (int j = 0; j < poly->size(); j++) {
-      const Point *p = &poly->at(j);
-      glVertex3d(p->x, p->y, p->z);
+// Vertex clustering: all vertices in the same cell of a grid with the given
+// number of cells along the longest side of the bounding box collapse into
+// their mean. Triangles and edges that collapse are dropped, as are
+// duplicates.
+static void gl_decimate(GLBatch *lod, const GLBatch *src, int cells) {
+  const BoundingBox &bb = src->bbox;
+  double size = fmax(bb.max[0] - bb.min[0], fmax(bb.max[1] - bb.min[1], bb.max[2] - bb.min[2])) / cells;
+  if (size <= 0)
+    size = 1;
+  int n[3];
+  for (int i = 0; i < 3; i++)
+    n[i] = (int) floor((bb.max[i] - bb.min[i]) / size) + 1;
+
+  QHash<int, int> cell_idx;
+  QVector<PolySet::Point> sum;
+  QVector<int> count;
+  QVector<int> surface_idx, edges_idx;
+  for (int k = 0; k < 2; k++) {
+    const QVector<GLfloat> &data = k == 0 ? src->surface : src->edges;
+    QVector<int> &idx = k == 0 ? surface_idx : edges_idx;
+    int stride = k == 0 ? 6 : 3, offset = k == 0 ? 3 : 0;
+    for (int i = offset; i < data.size(); i += stride) {
+      int c = 0;
+      for (int j = 2; j >= 0; j--) {
+        int ci = (int) floor((data[i + j] - bb.min[j]) / size);
+        c = c * n[j] + qBound(0, ci, n[j] - 1);
+      }
+      if (!cell_idx.contains(c)) {
+        cell_idx[c] = sum.size();
+        sum.append(PolySet::Point());
+        count.append(0);
+      }
+      int v = cell_idx[c];
+      sum[v].x += data[i], sum[v].y += data[i + 1], sum[v].z += data[i + 2];
+      count[v]++;
+      idx.append(v);
     }
-    glEnd();
   }
+  for (int i = 0; i < sum.size(); i++) {
+    sum[i].x /= count[i];
+    sum[i].y /= count[i];
+    sum[i].z /= count[i];
+  }
+
+  lod->bbox = bb;
+  lod->surface.clear();
+  lod->edges.clear();
+  QSet<quint64> seen;
+  for (int i = 0; i + 2 < surface_idx.size(); i += 3) {
+    int a = surface_idx[i], b = surface_idx[i + 1], c = surface_idx[i + 2];
+    if (a == b || b == c || c == a)
+      continue;
+    // Same triangle with the same orientation, starting at its lowest index
+    while (a > b || a > c) {
+      int t = a;
+      a = b, b = c, c = t;
+    }
+    quint64 key = ((quint64) a << 42) | ((quint64) b << 21) | (quint64) c;
+    if (seen.contains(key))
+      continue;
+    seen.insert(key);
+    gl_add_triangle(lod->surface, &sum[a], &sum[b], &sum[c]);
+  }
+  seen.clear();
+  for (int i = 0; i + 1 < edges_idx.size(); i += 2) {
+    int a = qMin(edges_idx[i], edges_idx[i + 1]), b = qMax(edges_idx[i], edges_idx[i + 1]);
+    if (a == b)
+      continue;
+    quint64 key = ((quint64) a << 32) | (quint64) b;
+    if (seen.contains(key))
+      continue;
+    seen.insert(key);
+    lod->edges << sum[a].x << sum[a].y << sum[a].z << sum[b].x << sum[b].y << sum[b].z;
+  }
+}
+
+// Polysets with fewer triangle vertices are always drawn in full
+#define GL_LOD_MIN_VERTICES 3000
+
+const GLBatch *PolySet::gl_lod(int level) const {
+  QMutexLocker locker(&gl_mutex);
+  gl_prepare_locked();
+  if (level <= 0 || gl.surface.size() / 6 < GL_LOD_MIN_VERTICES)
+    return &gl;
+  level = qMin(level, 2);
+  if (!gl_lods[level - 1]) {
+    gl_lods[level - 1] = new GLBatch();
+    gl_decimate(gl_lods[level - 1], &gl, level == 1 ? 64 : 16);
+    gl_lods[level - 1]->upload();
+  }
+  return gl_lods[level - 1];
+}
+
+// RGBA of surfaces and edges per color mode, also used by the software
+// rasterizer. COLORMODE_NONE leaves the current color alone.
+static const unsigned char ps_colors[5][2][4] = {
+  { { 0, 0, 0, 0 }, { 0, 0, 0, 0 } },
+  { { 249, 215, 44, 255 }, { 255, 236, 94, 255 } },
+  { { 157, 203, 81, 255 }, { 171, 216, 86, 255 } },
+  { { 255, 157, 81, 128 }, { 255, 171, 86, 128 } },
+  { { 180, 180, 180, 128 }, { 150, 150, 150, 128 } }
+};
+
+const unsigned char *PolySet::color(colormode_e colormode, bool edges) {
+  if (colormode == COLORMODE_NONE)
+    return NULL;
+  return ps_colors[colormode][edges ? 1 : 0];
+}
+
+void PolySet::gl_color(colormode_e colormode, bool edges) {
+  const unsigned char *c = color(colormode, edges);
+  if (c)
+    glColor4ubv(c);
+}
+
+void PolySet::render_surface(colormode_e colormode, GLint*) const {
+  gl_color(colormode, false);
+  gl_prepare();
+  gl.render_surface();
+}
+
+void PolySet::render_edges(colormode_e colormode) const {
+  gl_color(colormode, true);
+  gl_prepare();
+  gl.render_edges();
 }
 
 
@@ -213,17 +462,53 @@ PolySet *AbstractPolyNode::render_polyset(render_mode_e) const {
 }
 
 
-CGAL_Nef_polyhedron AbstractPolyNode::render_cgal_nef_polyhedron() const {
+// Vertex counts of the polygon meshes created for the CSG preview, by cache id.
+// The compile fills it, so planning the CGAL evaluation order later doesn't
+// have to create the meshes again.
+static QCache<QString, int> csg_vertices_cache(100000);
+static QMutex csg_vertices_cache_mutex;
+
+int AbstractPolyNode::cgal_cost_subtree() const {
+  // Only nodes that never made it into the preview (e.g. below render())
+  // have to create their mesh here.
   QString cache_id = mk_cache_id();
-  if (cgal_nef_cache.contains(cache_id)) {
+  {
+    QMutexLocker locker(&csg_vertices_cache_mutex);
+    int *vertices = csg_vertices_cache.object(cache_id);
+    if (vertices)
+      return *vertices;
+  }
+
+  PolySet *ps = render_polyset(RENDER_CGAL);
+  if (!ps)
+    return 0;
+  int cost = ps->number_of_vertices();
+  ps->unlink();
+  return cost;
+}
+
+CGAL_Nef_operand AbstractPolyNode::render_cgal_nef_polyhedron() const {
+  TraceSpan span("render_cgal_nef_polyhedron", this);
+  QString cache_id = mk_cache_id();
+  CGAL_Nef_operand N;
+  if (cgal_nef_cache_lookup(cache_id, N)) {
+    profile_cache_hit(this);
     progress_report();
-    return *cgal_nef_cache[cache_id];
+    return N;
   }
+  if (progress_cancelled())
+    return N;
 
+  QElapsedTimer timer;
+  timer.start();
   PolySet *ps = render_polyset(RENDER_CGAL);
-  CGAL_Nef_polyhedron N = ps->render_cgal_nef_polyhedron();
+  N = CGAL_Nef_operand(ps->render_cgal_nef_polyhedron(), ps->bounding_box());
+  int vertices_in = 0;
+  for (int i = 0; i < ps->polygons.size(); i++)
+    vertices_in += ps->polygons[i].size();
+  profile_node(this, timer.nsecsElapsed(), vertices_in, N.N.number_of_vertices());
 
-  cgal_nef_cache.insert(cache_id, new CGAL_Nef_polyhedron(N), N.number_of_vertices());
+  cgal_nef_cache_insert(cache_id, N);
   progress_report();
   ps->unlink();
   return N;
@@ -232,6 +517,10 @@ CGAL_Nef_polyhedron AbstractPolyNode::render_cgal_nef_polyhedron() const {
 
 CSGTerm *AbstractPolyNode::render_csg_term(double m[16], QVector<CSGTerm*> *highlights, QVector<CSGTerm*> *background) const {
   PolySet *ps = render_polyset(RENDER_OPENCSG);
+  {
+    QMutexLocker locker(&csg_vertices_cache_mutex);
+    csg_vertices_cache.insert(mk_cache_id(), new int(ps->number_of_vertices()));
+  }
   return render_csg_term_from_ps(m, highlights, background, ps, modinst, idx);
 }
 
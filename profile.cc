@@ -0,0 +1,161 @@
+/*
+ *  OpenSCAD (www.openscad.at)
+ *  Copyright (C) 2009  Clifford Wolf <clifford@clifford.at>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#define INCLUDE_ABSTRACT_NODE_DETAILS
+
+#include "openscad.h"
+
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <algorithm>
+
+bool profile_enabled;
+
+struct NodeProfile {
+  int idx;
+  int line;
+  QString modname;
+  QString label;
+  int calls;
+  int cache_hits;
+  qint64 nsecs;
+  int vertices_in;
+  int vertices_out;
+
+  NodeProfile() : idx(0), line(0), calls(0), cache_hits(0), nsecs(0), vertices_in(0), vertices_out(0) {
+  }
+};
+
+static QMutex profile_mutex;
+static QHash<int, NodeProfile> profile_data;
+
+static NodeProfile &profile_entry(const AbstractNode *node) {
+  NodeProfile &p = profile_data[node->idx];
+  if (p.calls == 0 && p.cache_hits == 0) {
+    p.idx = node->idx;
+    p.line = node->modinst->line;
+    p.modname = node->modinst->modname;
+    p.label = node->modinst->label;
+  }
+  return p;
+}
+
+void profile_reset() {
+  QMutexLocker locker(&profile_mutex);
+  profile_data.clear();
+}
+
+void profile_cache_hit(const AbstractNode *node) {
+  if (!profile_enabled)
+    return;
+  QMutexLocker locker(&profile_mutex);
+  profile_entry(node).cache_hits++;
+}
+
+void profile_node(const AbstractNode *node, qint64 nsecs, int vertices_in, int vertices_out) {
+  if (!profile_enabled)
+    return;
+  QMutexLocker locker(&profile_mutex);
+  NodeProfile &p = profile_entry(node);
+  p.calls++;
+  p.nsecs += nsecs;
+  p.vertices_in += vertices_in;
+  p.vertices_out += vertices_out;
+}
+
+int cgal_nef_vertices(const QList<CGAL_Nef_operand> &list) {
+  int vertices = 0;
+  foreach(const CGAL_Nef_operand &N, list)
+  vertices += N.N.number_of_vertices();
+  return vertices;
+}
+
+void profile_totals(int &cache_hits, int &cache_misses) {
+  QMutexLocker locker(&profile_mutex);
+  cache_hits = cache_misses = 0;
+  foreach(const NodeProfile &p, profile_data) {
+    cache_hits += p.cache_hits;
+    cache_misses += p.calls;
+  }
+}
+
+static bool profile_slower(const NodeProfile &a, const NodeProfile &b) {
+  return a.nsecs > b.nsecs;
+}
+
+static QList<NodeProfile> profile_sorted() {
+  QMutexLocker locker(&profile_mutex);
+  QList<NodeProfile> list = profile_data.values();
+  std::stable_sort(list.begin(), list.end(), profile_slower);
+  return list;
+}
+
+// The nodes are identified the same way as in the CSG tree dump (n<idx>),
+// together with the source line and the label of the module instantiation.
+static QString profile_node_name(const NodeProfile &p) {
+  QString name = QString("n%1: %2()").arg(p.idx).arg(p.modname.isEmpty() ? QString("group") : p.modname);
+  if (!p.label.isEmpty())
+    name = p.label + ": " + name;
+  return name;
+}
+
+QString profile_report(int max_nodes) {
+  QList<NodeProfile> list = profile_sorted();
+  qint64 total = 0;
+  foreach(const NodeProfile &p, list)
+  total += p.nsecs;
+
+  QString text = "Hot nodes (CGAL time spent in the node itself):\n";
+  text += "   time[ms]  share  miss   hit   vertices in -> out  line  node\n";
+  for (int i = 0; i < list.size() && i < max_nodes; i++) {
+    const NodeProfile &p = list[i];
+    QString line;
+    line.sprintf("  %9.1f %5.1f%% %5d %5d  %9d -> %-9d %5d  ", p.nsecs / 1e6,
+        total > 0 ? 100.0 * p.nsecs / total : 0.0, p.calls, p.cache_hits,
+        p.vertices_in, p.vertices_out, p.line);
+    text += line + profile_node_name(p) + "\n";
+  }
+  return text;
+}
+
+QByteArray profile_json() {
+  QList<NodeProfile> list = profile_sorted();
+  QJsonArray nodes;
+  qint64 total = 0;
+  foreach(const NodeProfile &p, list) {
+    QJsonObject n;
+    n["node"] = QString("n%1").arg(p.idx);
+    n["module"] = p.modname;
+    n["label"] = p.label;
+    n["line"] = p.line;
+    n["cache_misses"] = p.calls;
+    n["cache_hits"] = p.cache_hits;
+    n["time_ms"] = p.nsecs / 1e6;
+    n["vertices_in"] = p.vertices_in;
+    n["vertices_out"] = p.vertices_out;
+    nodes.append(n);
+    total += p.nsecs;
+  }
+  QJsonObject root;
+  root["total_ms"] = total / 1e6;
+  root["nodes"] = nodes;
+  return QJsonDocument(root).toJson();
+}
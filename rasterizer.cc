@@ -0,0 +1,551 @@
+/*
+ *  OpenSCAD (www.openscad.at)
+ *  Copyright (C) 2009  Clifford Wolf <clifford@clifford.at>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#define INCLUDE_ABSTRACT_NODE_DETAILS
+
+#include "openscad.h"
+
+#include <QCoreApplication>
+#include <QDir>
+#include <QFileInfo>
+#include <QImage>
+#include <QtConcurrentRun>
+#include <float.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Thumbnail mode: "openscad --rasterize [options] files" draws the thrown
+// together view (or with --mesh the CGAL result) of every file into PNG
+// images with a software rasterizer, without a window or OpenGL. All views
+// of a file are rendered at once: the images are cut into bands of rows and
+// worker threads take bands of any view until none are left.
+
+struct RasterView {
+  const char *name;
+  double rot_x, rot_z;
+};
+
+// The angles of GLView, the names of the View menu
+static const RasterView raster_views[] = {
+  { "diagonal", 35, 25 },
+  { "top", 90, 0 },
+  { "bottom", -90, 0 },
+  { "front", 0, 0 },
+  { "back", 0, 180 },
+  { "left", 0, 90 },
+  { "right", 0, -90 },
+  { NULL, 0, 0 }
+};
+
+// Triangles to draw: the vertex data of PolySet::gl_prepare() moved by m
+struct RasterInput {
+  const GLBatch *batch;
+  const double *m;
+  PolySet::colormode_e colormode;
+};
+
+struct RasterTriangle {
+  float x[3], y[3], z[3];
+  quint32 color;
+  int alpha;
+};
+
+#define RASTER_BAND 16
+
+struct RasterTarget {
+  QString output;
+  double rot_x, rot_z;
+  bool perspective;
+  int width, height, stride;
+
+  QVector<float> depth;
+  QVector<quint32> color;
+  QVector<RasterTriangle> tris;
+  // Triangle indices per band, opaque ones first
+  QVector< QVector<int> > bands;
+};
+
+static quint32 raster_rgb(int r, int g, int b) {
+  return 0xff000000 | (r << 16) | (g << 8) | b;
+}
+
+// Moves all triangles to pixel coordinates and bins them into bands. Depth
+// grows away from the viewer; with perspective it is -1 / distance, which
+// is linear in screen space like the z of OpenGL.
+static void raster_setup(RasterTarget &t, const QVector<RasterInput> &inputs) {
+  double ax = t.rot_x * M_PI / 180, az = t.rot_z * M_PI / 180;
+  // Rx(rot_x) * Rz(rot_z) as in GLView::paintGL(), world to view space
+  // with x to the right, y away from the viewer and z up
+  double r[3][3] = {
+    { cos(az), -sin(az), 0 },
+    { cos(ax) * sin(az), cos(ax) * cos(az), -sin(ax) },
+    { sin(ax) * sin(az), sin(ax) * cos(az), cos(ax) }
+  };
+
+  int vertices = 0;
+  for (int i = 0; i < inputs.size(); i++)
+    vertices += inputs[i].batch->surface.size() / 6;
+  QVector<double> v;
+  v.reserve(vertices * 3);
+  BoundingBox bb;
+  for (int i = 0; i < inputs.size(); i++) {
+    const QVector<GLfloat> &s = inputs[i].batch->surface;
+    const double *m = inputs[i].m;
+    for (int j = 0; j < s.size(); j += 6) {
+      double w[3] = {
+        m[0] * s[j + 3] + m[4] * s[j + 4] + m[8] * s[j + 5] + m[12],
+        m[1] * s[j + 3] + m[5] * s[j + 4] + m[9] * s[j + 5] + m[13],
+        m[2] * s[j + 3] + m[6] * s[j + 4] + m[10] * s[j + 5] + m[14]
+      };
+      for (int k = 0; k < 3; k++)
+        v.append(r[k][0] * w[0] + r[k][1] * w[1] + r[k][2] * w[2]);
+      bb.extend(v[v.size() - 3], v[v.size() - 2], v[v.size() - 1]);
+    }
+  }
+
+  double center[3] = { 0, 0, 0 }, scale = 1, distance = 1;
+  double w_h_ratio = sqrt((double) t.width / t.height);
+  if (!bb.is_empty()) {
+    double radius = 0;
+    for (int k = 0; k < 3; k++) {
+      center[k] = (bb.min[k] + bb.max[k]) / 2;
+      radius += (bb.max[k] - bb.min[k]) * (bb.max[k] - bb.min[k]) / 4;
+    }
+    radius = fmax(sqrt(radius), 1e-3);
+    if (t.perspective) {
+      double tan_half = fmin(w_h_ratio, 1 / w_h_ratio) / 10;
+      distance = radius * sqrt(1 + tan_half * tan_half) / tan_half;
+    } else {
+      scale = 0.9 * fmin(t.width / fmax(bb.max[0] - bb.min[0], 1e-6),
+          t.height / fmax(bb.max[2] - bb.min[2], 1e-6));
+    }
+  }
+
+  t.stride = (t.width + 3) & ~3;
+  t.depth.fill(FLT_MAX, t.stride * t.height);
+  t.color.fill(raster_rgb(255, 255, 230), t.stride * t.height);
+  t.bands.clear();
+  t.bands.resize((t.height + RASTER_BAND - 1) / RASTER_BAND);
+  t.tris.clear();
+
+  // The lights of GLView::paintGL()
+  static const double lights[2][3] = {
+    { -0.57735, -0.57735, +0.57735 },
+    { +0.57735, +0.57735, -0.57735 }
+  };
+
+  QVector<int> translucent;
+  int vi = 0;
+  for (int i = 0; i < inputs.size(); i++) {
+    const QVector<GLfloat> &s = inputs[i].batch->surface;
+    double nm[9];
+    GLBatch::normal_matrix(inputs[i].m, nm);
+    const unsigned char *rgba = PolySet::color(inputs[i].colormode, false);
+    for (int j = 0; j < s.size(); j += 18, vi += 9) {
+      RasterTriangle tri;
+      bool behind = false;
+      for (int k = 0; k < 3; k++) {
+        double x = v[vi + k*3] - center[0];
+        double y = v[vi + k*3 + 1] - center[1];
+        double z = v[vi + k*3 + 2] - center[2];
+        if (t.perspective) {
+          double eye = y + distance;
+          if (eye < 1e-6)
+            behind = true;
+          tri.x[k] = (10 * x / (eye * w_h_ratio) + 1) * t.width / 2;
+          tri.y[k] = (1 - 10 * z * w_h_ratio / eye) * t.height / 2;
+          tri.z[k] = -1 / eye;
+        } else {
+          tri.x[k] = t.width / 2 + x * scale;
+          tri.y[k] = t.height / 2 - z * scale;
+          tri.z[k] = y;
+        }
+      }
+      if (behind)
+        continue;
+
+      // Flat shading with the normal of gl_prepare(), turned to the viewer
+      double wn[3] = {
+        nm[0] * s[j] + nm[3] * s[j + 1] + nm[6] * s[j + 2],
+        nm[1] * s[j] + nm[4] * s[j + 1] + nm[7] * s[j + 2],
+        nm[2] * s[j] + nm[5] * s[j + 1] + nm[8] * s[j + 2]
+      };
+      double n[3];
+      for (int k = 0; k < 3; k++)
+        n[k] = r[k][0] * wn[0] + r[k][1] * wn[1] + r[k][2] * wn[2];
+      double nl = sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+      if (nl == 0)
+        nl = 1;
+      if (n[1] > 0)
+        nl = -nl;
+      double diffuse = 0.2;
+      for (int k = 0; k < 2; k++)
+        diffuse += fmax(0, (n[0] * lights[k][0] + n[1] * lights[k][1] + n[2] * lights[k][2]) / nl);
+      diffuse = fmin(diffuse, 1.0);
+      tri.color = raster_rgb(rgba[0] * diffuse, rgba[1] * diffuse, rgba[2] * diffuse);
+      tri.alpha = rgba[3];
+
+      float ymin = fmin(tri.y[0], fmin(tri.y[1], tri.y[2]));
+      float ymax = fmax(tri.y[0], fmax(tri.y[1], tri.y[2]));
+      int b0 = qMax(0, (int) floor(ymin) / RASTER_BAND);
+      int b1 = qMin(t.bands.size() - 1, (int) ceil(ymax) / RASTER_BAND);
+      if (ymax < 0 || b0 > b1)
+        continue;
+      int idx = t.tris.size();
+      t.tris.append(tri);
+      if (tri.alpha < 255) {
+        translucent.append(idx);
+        continue;
+      }
+      for (int b = b0; b <= b1; b++)
+        t.bands[b].append(idx);
+    }
+  }
+
+  // Translucent triangles (highlights and background) go over the rest
+  for (int i = 0; i < translucent.size(); i++) {
+    const RasterTriangle &tri = t.tris[translucent[i]];
+    float ymin = fmin(tri.y[0], fmin(tri.y[1], tri.y[2]));
+    float ymax = fmax(tri.y[0], fmax(tri.y[1], tri.y[2]));
+    int b0 = qMax(0, (int) floor(ymin) / RASTER_BAND);
+    int b1 = qMin(t.bands.size() - 1, (int) ceil(ymax) / RASTER_BAND);
+    for (int b = b0; b <= b1; b++)
+      t.bands[b].append(translucent[i]);
+  }
+}
+
+static quint32 raster_blend(quint32 dst, quint32 src, int alpha) {
+  int r = (((src >> 16) & 0xff) * alpha + ((dst >> 16) & 0xff) * (255 - alpha)) / 255;
+  int g = (((src >> 8) & 0xff) * alpha + ((dst >> 8) & 0xff) * (255 - alpha)) / 255;
+  int b = ((src & 0xff) * alpha + (dst & 0xff) * (255 - alpha)) / 255;
+  return raster_rgb(r, g, b);
+}
+
+// Draws the part of a triangle in rows y0 to y1 - 1 with edge functions
+// sampled at the pixel centers, four pixels at a time with SSE2. Opaque
+// triangles write the depth buffer, translucent ones are blended over what
+// is in front of them.
+static void raster_triangle(RasterTarget &t, const RasterTriangle &tri, int y0, int y1) {
+  double x[3] = { tri.x[0], tri.x[1], tri.x[2] };
+  double y[3] = { tri.y[0], tri.y[1], tri.y[2] };
+  double z[3] = { tri.z[0], tri.z[1], tri.z[2] };
+  double area = (x[1] - x[0]) * (y[2] - y[0]) - (y[1] - y[0]) * (x[2] - x[0]);
+  if (fabs(area) < 1e-12)
+    return;
+  if (area < 0) {
+    qSwap(x[1], x[2]);
+    qSwap(y[1], y[2]);
+    qSwap(z[1], z[2]);
+    area = -area;
+  }
+
+  int xmin = qMax(0, (int) floor(fmin(x[0], fmin(x[1], x[2]))));
+  int xmax = qMin(t.width - 1, (int) ceil(fmax(x[0], fmax(x[1], x[2]))));
+  int ymin = qMax(y0, (int) floor(fmin(y[0], fmin(y[1], y[2]))));
+  int ymax = qMin(y1 - 1, (int) ceil(fmax(y[0], fmax(y[1], y[2]))));
+  if (xmin > xmax || ymin > ymax)
+    return;
+  xmin &= ~3;
+
+  // Edge i is opposite to vertex i: e(p) = a * px + b * py + c
+  double ea[3], eb[3], ec[3];
+  for (int i = 0; i < 3; i++) {
+    int j = (i + 1) % 3, k = (i + 2) % 3;
+    ea[i] = -(y[k] - y[j]);
+    eb[i] = x[k] - x[j];
+    ec[i] = -(ea[i] * x[j] + eb[i] * y[j]);
+  }
+  double za = 0, zb = 0, zc = 0;
+  for (int i = 0; i < 3; i++) {
+    za += ea[i] * z[i] / area;
+    zb += eb[i] * z[i] / area;
+    zc += ec[i] * z[i] / area;
+  }
+
+  bool opaque = tri.alpha == 255;
+  for (int py = ymin; py <= ymax; py++) {
+    float *zrow = t.depth.data() + py * t.stride;
+    quint32 *crow = t.color.data() + py * t.stride;
+    double cy = py + 0.5, cx = xmin + 0.5;
+    double w0 = ea[0] * cx + eb[0] * cy + ec[0];
+    double w1 = ea[1] * cx + eb[1] * cy + ec[1];
+    double w2 = ea[2] * cx + eb[2] * cy + ec[2];
+    double wz = za * cx + zb * cy + zc;
+    int px = xmin;
+#ifdef __SSE2__
+    __m128 step = _mm_set_ps(3, 2, 1, 0);
+    __m128 v0 = _mm_add_ps(_mm_set1_ps(w0), _mm_mul_ps(step, _mm_set1_ps(ea[0])));
+    __m128 v1 = _mm_add_ps(_mm_set1_ps(w1), _mm_mul_ps(step, _mm_set1_ps(ea[1])));
+    __m128 v2 = _mm_add_ps(_mm_set1_ps(w2), _mm_mul_ps(step, _mm_set1_ps(ea[2])));
+    __m128 vz = _mm_add_ps(_mm_set1_ps(wz), _mm_mul_ps(step, _mm_set1_ps(za)));
+    __m128 d0 = _mm_set1_ps(4 * ea[0]), d1 = _mm_set1_ps(4 * ea[1]);
+    __m128 d2 = _mm_set1_ps(4 * ea[2]), dz = _mm_set1_ps(4 * za);
+    __m128 zero = _mm_setzero_ps();
+    __m128i color = _mm_set1_epi32(tri.color);
+    for (; px <= xmax; px += 4) {
+      __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(v0, zero), _mm_cmpge_ps(v1, zero)), _mm_cmpge_ps(v2, zero));
+      if (_mm_movemask_ps(inside)) {
+        __m128 old_z = _mm_loadu_ps(zrow + px);
+        __m128 mask = _mm_and_ps(inside, _mm_cmplt_ps(vz, old_z));
+        if (opaque) {
+          _mm_storeu_ps(zrow + px, _mm_or_ps(_mm_and_ps(mask, vz), _mm_andnot_ps(mask, old_z)));
+          __m128i m = _mm_castps_si128(mask);
+          __m128i old_c = _mm_loadu_si128((__m128i*) (crow + px));
+          _mm_storeu_si128((__m128i*) (crow + px), _mm_or_si128(_mm_and_si128(m, color), _mm_andnot_si128(m, old_c)));
+        } else {
+          int bits = _mm_movemask_ps(mask);
+          for (int i = 0; i < 4; i++) {
+            if (bits & (1 << i))
+              crow[px + i] = raster_blend(crow[px + i], tri.color, tri.alpha);
+          }
+        }
+      }
+      v0 = _mm_add_ps(v0, d0);
+      v1 = _mm_add_ps(v1, d1);
+      v2 = _mm_add_ps(v2, d2);
+      vz = _mm_add_ps(vz, dz);
+    }
+#else
+    for (; px <= xmax; px++) {
+      if (w0 >= 0 && w1 >= 0 && w2 >= 0 && wz < zrow[px]) {
+        if (opaque) {
+          zrow[px] = wz;
+          crow[px] = tri.color;
+        } else {
+          crow[px] = raster_blend(crow[px], tri.color, tri.alpha);
+        }
+      }
+      w0 += ea[0];
+      w1 += ea[1];
+      w2 += ea[2];
+      wz += za;
+    }
+#endif
+  }
+}
+
+struct RasterJob {
+  QVector<RasterTarget> *targets;
+  int bands_per_target;
+  QAtomicInt next_band;
+};
+
+static void raster_worker(RasterJob *job) {
+  int bands = job->targets->size() * job->bands_per_target;
+  while (1) {
+    int band = job->next_band.fetchAndAddRelaxed(1);
+    if (band >= bands)
+      return;
+    RasterTarget &t = (*job->targets)[band / job->bands_per_target];
+    int b = band % job->bands_per_target;
+    if (b >= t.bands.size())
+      continue;
+    int y0 = b * RASTER_BAND, y1 = qMin(y0 + RASTER_BAND, t.height);
+    const QVector<int> &tris = t.bands[b];
+    for (int i = 0; i < tris.size(); i++)
+      raster_triangle(t, t.tris[tris[i]], y0, y1);
+  }
+}
+
+static void raster_render(QVector<RasterTarget> &targets, const QVector<RasterInput> &inputs) {
+  RasterJob job;
+  job.targets = &targets;
+  job.bands_per_target = 0;
+  job.next_band.store(0);
+  for (int i = 0; i < targets.size(); i++) {
+    raster_setup(targets[i], inputs);
+    job.bands_per_target = qMax(job.bands_per_target, targets[i].bands.size());
+  }
+
+  QList< QFuture<void> > futures;
+  for (int i = 0; i < QThread::idealThreadCount(); i++)
+    futures.append(QtConcurrent::run(raster_worker, &job));
+  for (int i = 0; i < futures.size(); i++)
+    futures[i].waitForFinished();
+}
+
+static QImage raster_image(const RasterTarget &t) {
+  QImage img(t.width, t.height, QImage::Format_RGB32);
+  for (int y = 0; y < t.height; y++)
+    memcpy(img.scanLine(y), t.color.constData() + y * t.stride, t.width * sizeof(quint32));
+  return img;
+}
+
+static void raster_add_chain(QVector<RasterInput> &inputs, CSGChain *chain, bool highlight, bool background) {
+  if (!chain)
+    return;
+  QHash<QPair<PolySet*, double*>, int> polySetVisitMark;
+  for (int i = 0; i < chain->polysets.size(); i++) {
+    if (polySetVisitMark[QPair<PolySet*, double*>(chain->polysets[i], chain->matrices[i])]++ > 0)
+      continue;
+    // Off the GUI thread gl_prepare() only builds the client side arrays
+    chain->polysets[i]->gl_prepare();
+    RasterInput in;
+    in.batch = &chain->polysets[i]->gl;
+    in.m = chain->matrices[i];
+    in.colormode = chain->colormode(i, highlight, background);
+    inputs.append(in);
+  }
+}
+
+static PolySet *raster_final_polyset(AbstractNode *root) {
+  CGAL_Nef_polyhedron N = root->render_cgal_nef_polyhedron().N;
+  if (!N.is_simple()) {
+    PRINT("Object isn't a valid 2-manifold! Modify your design..");
+    return NULL;
+  }
+  PolySet *ps = new PolySet();
+  nef_to_polyset(ps, N);
+  return ps;
+}
+
+static void rasterize_usage() {
+  fprintf(stderr, "Usage: openscad --rasterize [-o output.png | -d output_dir] [-s WIDTHxHEIGHT]\n"
+      "                          [-v view[,view ...] | -r rot_x,rot_z] [--perspective] [--mesh]\n"
+      "                          file.scad ...\n"
+      "Views: diagonal (default), top, bottom, front, back, left, right\n");
+}
+
+struct RasterizeJob {
+  HeadlessImageArgs args;
+  QList<RasterView> views;
+  bool perspective, mesh;
+  int failed;
+
+  RasterizeJob() : args(256), perspective(false), mesh(false), failed(0) {
+  }
+};
+
+static bool rasterize_file(const RasterizeJob *job, const QString &filename) {
+  CompiledDesign *d = compile_file(filename);
+  if (!d)
+    return false;
+
+  QVector<RasterInput> inputs;
+  PolySet *final_ps = NULL;
+  double identity[16];
+  for (int i = 0; i < 16; i++)
+    identity[i] = i % 5 == 0 ? 1.0 : 0.0;
+  if (job->mesh && d->root_node) {
+    // Imports are read relative to the design, as in compile_file()
+    QString old_dir = QDir::currentPath();
+    QDir::setCurrent(QFileInfo(filename).absolutePath());
+    final_ps = raster_final_polyset(d->root_node);
+    QDir::setCurrent(old_dir);
+    if (final_ps) {
+      final_ps->gl_prepare();
+      RasterInput in = { &final_ps->gl, identity, PolySet::COLORMODE_MATERIAL };
+      inputs.append(in);
+    }
+  } else {
+    raster_add_chain(inputs, d->root_chain, false, false);
+    raster_add_chain(inputs, d->background_chain, false, true);
+    raster_add_chain(inputs, d->highlights_chain, true, false);
+  }
+
+  bool ok = d->root_node && (!job->mesh || final_ps);
+  if (ok) {
+    QVector<RasterTarget> targets(job->views.size());
+    for (int i = 0; i < job->views.size(); i++) {
+      RasterTarget &t = targets[i];
+      QString suffix;
+      if (job->views.size() > 1)
+        suffix = QString("_") + job->views[i].name;
+      t.output = job->args.output(filename, suffix);
+      t.rot_x = job->views[i].rot_x;
+      t.rot_z = job->views[i].rot_z;
+      t.perspective = job->perspective;
+      t.width = job->args.width;
+      t.height = job->args.height;
+    }
+    raster_render(targets, inputs);
+    for (int i = 0; i < targets.size(); i++) {
+      if (!raster_image(targets[i]).save(targets[i].output, "PNG")) {
+        fprintf(stderr, "Can't write `%s'.\n", targets[i].output.toLocal8Bit().data());
+        ok = false;
+      }
+    }
+  }
+
+  if (final_ps)
+    final_ps->unlink();
+  delete d;
+  return ok;
+}
+
+static void rasterize_job(void *vp) {
+  RasterizeJob *job = (RasterizeJob*) vp;
+  foreach(const QString &file, job->args.files) {
+    QElapsedTimer timer;
+    timer.start();
+    if (!rasterize_file(job, file)) {
+      job->failed++;
+      continue;
+    }
+    printf("%s: %d view(s) in %.0f ms\n", file.toLocal8Bit().data(),
+        job->views.size(), timer.nsecsElapsed() / 1e6);
+  }
+}
+
+int rasterize_main(int argc, char **argv) {
+  QCoreApplication app(argc, argv);
+  RasterizeJob job;
+
+  for (int i = 2; i < argc; i++) {
+    QString arg = argv[i];
+    if (arg == "-v" && i + 1 < argc) {
+      foreach(const QString &name, QString(argv[++i]).split(",")) {
+        int j = 0;
+        while (raster_views[j].name && name != raster_views[j].name)
+          j++;
+        if (!raster_views[j].name) {
+          rasterize_usage();
+          return 1;
+        }
+        job.views.append(raster_views[j]);
+      }
+    } else if (arg == "-r" && i + 1 < argc) {
+      RasterView v = { "custom", 0, 0 };
+      if (sscanf(argv[++i], "%lf,%lf", &v.rot_x, &v.rot_z) != 2) {
+        rasterize_usage();
+        return 1;
+      }
+      job.views.append(v);
+    } else if (arg == "--perspective") {
+      job.perspective = true;
+    } else if (arg == "--mesh") {
+      job.mesh = true;
+    } else if (!job.args.parse(argc, argv, i)) {
+      rasterize_usage();
+      return 1;
+    }
+  }
+  if (job.views.isEmpty())
+    job.views.append(raster_views[0]);
+  if (!job.args.valid(job.views.size())) {
+    rasterize_usage();
+    return 1;
+  }
+
+  headless_run(rasterize_job, &job);
+  return job.failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,864 @@
+/*
+ *  OpenSCAD (www.openscad.at)
+ *  Copyright (C) 2009  Clifford Wolf <clifford@clifford.at>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#define INCLUDE_ABSTRACT_NODE_DETAILS
+
+#include "openscad.h"
+
+#include <QCoreApplication>
+#include <QImage>
+#include <QThreadStorage>
+#include <QtConcurrentRun>
+#include <algorithm>
+
+// Ray casting preview: every ray classifies itself against the raw CSG tree
+// (not the normalized products), so there is no product limit and the
+// result is exact CSG up to the tessellation of the primitives.
+//
+// Each polyset gets a bounding volume hierarchy over its triangles in its
+// own coordinates, primitives hold the inverse of their matrix and the rays
+// are moved into polyset space. Along a ray a primitive is a list of
+// inside spans; the spans are combined bottom up through the tree.
+
+struct RayTriangle {
+  double v0[3], e1[3], e2[3];
+  double n[3];
+};
+
+struct RayHit {
+  double t;
+  const RayTriangle *tri;
+
+  bool operator<(const RayHit &other) const {
+    return t < other.t;
+  }
+};
+
+class RayMesh {
+public:
+  // Inner nodes (count == 0) have their children at first and first + 1
+  struct Node {
+    double min[3], max[3];
+    int first, count;
+  };
+
+  QVector<RayTriangle> tris;
+  QVector<Node> nodes;
+
+  RayMesh(const PolySet *ps);
+  void intersect(const double o[3], const double d[3], const double inv_d[3], QVector<RayHit> &hits) const;
+};
+
+static void ray_add_triangle(QVector<RayTriangle> &tris, const PolySet::Point &p0, const PolySet::Point &p1, const PolySet::Point &p2) {
+  RayTriangle t;
+  double a[3] = { p0.x, p0.y, p0.z };
+  double b[3] = { p1.x, p1.y, p1.z };
+  double c[3] = { p2.x, p2.y, p2.z };
+  for (int i = 0; i < 3; i++) {
+    t.v0[i] = a[i];
+    t.e1[i] = b[i] - a[i];
+    t.e2[i] = c[i] - a[i];
+  }
+  t.n[0] = t.e1[1] * t.e2[2] - t.e1[2] * t.e2[1];
+  t.n[1] = t.e1[2] * t.e2[0] - t.e1[0] * t.e2[2];
+  t.n[2] = t.e1[0] * t.e2[1] - t.e1[1] * t.e2[0];
+  if (t.n[0] == 0 && t.n[1] == 0 && t.n[2] == 0)
+    return;
+  tris.append(t);
+}
+
+#define RAY_LEAF_SIZE 4
+
+struct RayCentroidLess {
+  const double *centroid;
+  int axis;
+
+  bool operator()(int a, int b) const {
+    return centroid[a*3 + axis] < centroid[b*3 + axis];
+  }
+};
+
+struct RayBuildTodo {
+  int node, begin, end;
+};
+
+RayMesh::RayMesh(const PolySet *ps) {
+  // Same tessellation as PolySet::gl_prepare()
+  for (int i = 0; i < ps->polygons.size(); i++) {
+    const PolySet::Polygon *poly = &ps->polygons[i];
+    if (poly->size() == 3) {
+      ray_add_triangle(tris, poly->at(0), poly->at(1), poly->at(2));
+    } else if (poly->size() == 4) {
+      ray_add_triangle(tris, poly->at(0), poly->at(1), poly->at(3));
+      ray_add_triangle(tris, poly->at(2), poly->at(3), poly->at(1));
+    } else if (poly->size() > 4) {
+      PolySet::Point center;
+      for (int j = 0; j < poly->size(); j++) {
+        center.x += poly->at(j).x;
+        center.y += poly->at(j).y;
+        center.z += poly->at(j).z;
+      }
+      center.x /= poly->size();
+      center.y /= poly->size();
+      center.z /= poly->size();
+      for (int j = 1; j <= poly->size(); j++)
+        ray_add_triangle(tris, center, poly->at(j - 1), poly->at(j % poly->size()));
+    }
+  }
+
+  // Top down, split at the median centroid along the longest side
+  QVector<int> order(tris.size());
+  QVector<double> centroid(tris.size() * 3);
+  for (int i = 0; i < tris.size(); i++) {
+    order[i] = i;
+    for (int j = 0; j < 3; j++)
+      centroid[i*3 + j] = tris[i].v0[j] + (tris[i].e1[j] + tris[i].e2[j]) / 3;
+  }
+
+  QVector<RayBuildTodo> todo;
+  nodes.append(Node());
+  RayBuildTodo root = { 0, 0, tris.size() };
+  todo.append(root);
+  while (!todo.isEmpty()) {
+    RayBuildTodo t = todo.takeLast();
+    Node &n = nodes[t.node];
+    for (int j = 0; j < 3; j++) {
+      n.min[j] = +HUGE_VAL;
+      n.max[j] = -HUGE_VAL;
+    }
+    for (int i = t.begin; i < t.end; i++) {
+      const RayTriangle &tri = tris[order[i]];
+      for (int j = 0; j < 3; j++) {
+        double v[3] = { tri.v0[j], tri.v0[j] + tri.e1[j], tri.v0[j] + tri.e2[j] };
+        n.min[j] = fmin(n.min[j], fmin(v[0], fmin(v[1], v[2])));
+        n.max[j] = fmax(n.max[j], fmax(v[0], fmax(v[1], v[2])));
+      }
+    }
+    if (t.end - t.begin <= RAY_LEAF_SIZE) {
+      n.first = t.begin;
+      n.count = t.end - t.begin;
+      continue;
+    }
+    int axis = 0;
+    for (int j = 1; j < 3; j++) {
+      if (n.max[j] - n.min[j] > n.max[axis] - n.min[axis])
+        axis = j;
+    }
+    int mid = (t.begin + t.end) / 2;
+    RayCentroidLess less = { centroid.constData(), axis };
+    std::nth_element(order.begin() + t.begin, order.begin() + mid, order.begin() + t.end, less);
+    n.first = nodes.size();
+    n.count = 0;
+    RayBuildTodo left = { nodes.size(), t.begin, mid };
+    RayBuildTodo right = { nodes.size() + 1, mid, t.end };
+    // n is invalid from here on
+    nodes.append(Node());
+    nodes.append(Node());
+    todo.append(left);
+    todo.append(right);
+  }
+
+  QVector<RayTriangle> sorted(tris.size());
+  for (int i = 0; i < tris.size(); i++)
+    sorted[i] = tris[order[i]];
+  tris = sorted;
+}
+
+// All hits along the line through o in direction d, including those behind
+// the origin: the spans need them to know what is inside.
+void RayMesh::intersect(const double o[3], const double d[3], const double inv_d[3], QVector<RayHit> &hits) const {
+  if (tris.isEmpty())
+    return;
+  int stack[64];
+  int sp = 0;
+  stack[sp++] = 0;
+  while (sp > 0) {
+    const Node &n = nodes[stack[--sp]];
+    double tmin = -HUGE_VAL, tmax = +HUGE_VAL;
+    for (int j = 0; j < 3; j++) {
+      double t1 = (n.min[j] - o[j]) * inv_d[j];
+      double t2 = (n.max[j] - o[j]) * inv_d[j];
+      // fmin/fmax drop the NaN of 0 * inf for rays parallel to a side
+      tmin = fmax(tmin, fmin(t1, t2));
+      tmax = fmin(tmax, fmax(t1, t2));
+    }
+    if (tmin > tmax)
+      continue;
+    if (n.count == 0) {
+      if (sp + 2 > 64)
+        continue;
+      stack[sp++] = n.first;
+      stack[sp++] = n.first + 1;
+      continue;
+    }
+    for (int i = n.first; i < n.first + n.count; i++) {
+      // Moeller-Trumbore, without a range for t
+      const RayTriangle &tri = tris[i];
+      double p[3] = {
+        d[1] * tri.e2[2] - d[2] * tri.e2[1],
+        d[2] * tri.e2[0] - d[0] * tri.e2[2],
+        d[0] * tri.e2[1] - d[1] * tri.e2[0]
+      };
+      double det = tri.e1[0] * p[0] + tri.e1[1] * p[1] + tri.e1[2] * p[2];
+      if (det == 0)
+        continue;
+      double s[3] = { o[0] - tri.v0[0], o[1] - tri.v0[1], o[2] - tri.v0[2] };
+      double u = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) / det;
+      if (u < 0 || u > 1)
+        continue;
+      double q[3] = {
+        s[1] * tri.e1[2] - s[2] * tri.e1[1],
+        s[2] * tri.e1[0] - s[0] * tri.e1[2],
+        s[0] * tri.e1[1] - s[1] * tri.e1[0]
+      };
+      double v = (d[0] * q[0] + d[1] * q[1] + d[2] * q[2]) / det;
+      if (v < 0 || u + v > 1)
+        continue;
+      RayHit h;
+      h.t = (tri.e2[0] * q[0] + tri.e2[1] * q[1] + tri.e2[2] * q[2]) / det;
+      h.tri = &tri;
+      hits.append(h);
+    }
+  }
+}
+
+struct RayPrim {
+  const RayMesh *mesh;
+  double inv[12];   // world to polyset space, 3x4 row major
+};
+
+// The tree in pre-order, every node knows the size of its subtree so that
+// subtrees the ray misses are skipped at once.
+struct RayNode {
+  CSGTerm::type_e type;
+  int size;
+  int prim;
+  BoundingBox bbox;
+};
+
+// The surfaces where a span starts and ends. Normals point out of the span.
+struct RaySpan {
+  double t0, t1;
+  double n0[3], n1[3];
+  bool cut0, cut1;
+};
+
+typedef QVector<RaySpan> RaySpans;
+
+class RayScene {
+public:
+  QVector<RayNode> nodes;
+  QVector<RayPrim> prims;
+  QHash<const PolySet*, RayMesh*> meshes;
+
+  RayScene(CSGTerm *term);
+  ~RayScene();
+
+  bool trace(const double o[3], const double d[3], RaySpan &hit) const;
+
+private:
+  void add(CSGTerm *term);
+  void add_balanced(CSGTerm::type_e type, QVector<CSGTerm*> &terms, int begin, int end);
+};
+
+static bool ray_invert(const double m[16], double inv[12]) {
+  // Column major 4x4 (OpenGL) to row major 3x4
+  double a[3][3] = {
+    { m[0], m[4], m[8] },
+    { m[1], m[5], m[9] },
+    { m[2], m[6], m[10] }
+  };
+  double det = a[0][0] * (a[1][1] * a[2][2] - a[1][2] * a[2][1])
+      - a[0][1] * (a[1][0] * a[2][2] - a[1][2] * a[2][0])
+      + a[0][2] * (a[1][0] * a[2][1] - a[1][1] * a[2][0]);
+  if (det == 0)
+    return false;
+  double r[3][3];
+  for (int i = 0; i < 3; i++)
+    for (int j = 0; j < 3; j++) {
+      int i1 = (i + 1) % 3, i2 = (i + 2) % 3;
+      int j1 = (j + 1) % 3, j2 = (j + 2) % 3;
+      r[j][i] = (a[i1][j1] * a[i2][j2] - a[i1][j2] * a[i2][j1]) / det;
+    }
+  double t[3] = { m[12], m[13], m[14] };
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++)
+      inv[i*4 + j] = r[i][j];
+    inv[i*4 + 3] = -(r[i][0] * t[0] + r[i][1] * t[1] + r[i][2] * t[2]);
+  }
+  return true;
+}
+
+RayScene::RayScene(CSGTerm *term) {
+  if (term)
+    add(term);
+}
+
+RayScene::~RayScene() {
+  foreach(RayMesh *mesh, meshes)
+  delete mesh;
+}
+
+// Chains of the same associative operation are flattened and emitted as
+// balanced trees split along the longest side, so that both the depth of
+// the evaluation and the number of nodes a ray visits stay logarithmic.
+// A chain of differences a - b - c - ... becomes a - (b + c + ...).
+void RayScene::add(CSGTerm *term) {
+  if (term->type == CSGTerm::TYPE_PRIMITIVE) {
+    RayNode n;
+    n.type = CSGTerm::TYPE_PRIMITIVE;
+    n.size = 1;
+    n.prim = -1;
+    n.bbox = term->bbox;
+    RayPrim p;
+    if (term->polyset && ray_invert(term->m, p.inv)) {
+      if (!meshes.contains(term->polyset))
+        meshes[term->polyset] = new RayMesh(term->polyset);
+      p.mesh = meshes[term->polyset];
+      n.prim = prims.size();
+      prims.append(p);
+    } else {
+      n.bbox = BoundingBox();
+    }
+    nodes.append(n);
+    return;
+  }
+
+  QVector<CSGTerm*> terms;
+  if (term->type == CSGTerm::TYPE_DIFFERENCE) {
+    QVector<CSGTerm*> subtrahends;
+    while (term->type == CSGTerm::TYPE_DIFFERENCE) {
+      subtrahends.append(term->right);
+      term = term->left;
+    }
+    int idx = nodes.size();
+    nodes.append(RayNode());
+    nodes[idx].type = CSGTerm::TYPE_DIFFERENCE;
+    nodes[idx].prim = -1;
+    add(term);
+    add_balanced(CSGTerm::TYPE_UNION, subtrahends, 0, subtrahends.size());
+    nodes[idx].size = nodes.size() - idx;
+    nodes[idx].bbox = nodes[idx + 1].bbox;
+    return;
+  }
+
+  QVector<CSGTerm*> stack;
+  stack.append(term);
+  while (!stack.isEmpty()) {
+    CSGTerm *t = stack.takeLast();
+    if (t->type == term->type) {
+      stack.append(t->right);
+      stack.append(t->left);
+    } else {
+      terms.append(t);
+    }
+  }
+  add_balanced(term->type, terms, 0, terms.size());
+}
+
+struct RayTermLess {
+  int axis;
+
+  bool operator()(const CSGTerm *a, const CSGTerm *b) const {
+    return a->bbox.min[axis] + a->bbox.max[axis] < b->bbox.min[axis] + b->bbox.max[axis];
+  }
+};
+
+void RayScene::add_balanced(CSGTerm::type_e type, QVector<CSGTerm*> &terms, int begin, int end) {
+  if (end - begin == 1) {
+    add(terms[begin]);
+    return;
+  }
+
+  BoundingBox bb;
+  for (int i = begin; i < end; i++)
+    bb.extend(terms[i]->bbox);
+  int axis = 0;
+  if (!bb.is_empty()) {
+    for (int j = 1; j < 3; j++) {
+      if (bb.max[j] - bb.min[j] > bb.max[axis] - bb.min[axis])
+        axis = j;
+    }
+  }
+  int mid = (begin + end) / 2;
+  RayTermLess less = { axis };
+  std::nth_element(terms.begin() + begin, terms.begin() + mid, terms.begin() + end, less);
+
+  int idx = nodes.size();
+  nodes.append(RayNode());
+  nodes[idx].type = type;
+  nodes[idx].prim = -1;
+  int left = nodes.size();
+  add_balanced(type, terms, begin, mid);
+  int right = nodes.size();
+  add_balanced(type, terms, mid, end);
+  nodes[idx].size = nodes.size() - idx;
+  if (type == CSGTerm::TYPE_UNION) {
+    nodes[idx].bbox = nodes[left].bbox;
+    nodes[idx].bbox.extend(nodes[right].bbox);
+  } else {
+    nodes[idx].bbox = nodes[left].bbox.intersection(nodes[right].bbox);
+  }
+}
+
+static bool ray_hits_box(const BoundingBox &bb, const double o[3], const double inv_d[3]) {
+  if (bb.is_empty())
+    return false;
+  double tmin = -HUGE_VAL, tmax = +HUGE_VAL;
+  for (int j = 0; j < 3; j++) {
+    double t1 = (bb.min[j] - o[j]) * inv_d[j];
+    double t2 = (bb.max[j] - o[j]) * inv_d[j];
+    tmin = fmax(tmin, fmin(t1, t2));
+    tmax = fmin(tmax, fmax(t1, t2));
+  }
+  return tmin <= tmax;
+}
+
+// Per thread scratch space, reused between rays
+struct RayScratch {
+  QVector<RayHit> hits;
+  QVector<RaySpans> values;
+  RaySpans tmp;
+  struct Frame {
+    int node;
+    bool left_done;
+  };
+  QVector<Frame> frames;
+};
+
+static RayScratch *ray_scratch_local();
+
+static void ray_normal(const RayPrim &p, const double n[3], const double d[3], bool outward_along_d, double out[3]) {
+  // The inverse transpose of the matrix moves normals to world space
+  out[0] = p.inv[0] * n[0] + p.inv[4] * n[1] + p.inv[8] * n[2];
+  out[1] = p.inv[1] * n[0] + p.inv[5] * n[1] + p.inv[9] * n[2];
+  out[2] = p.inv[2] * n[0] + p.inv[6] * n[1] + p.inv[10] * n[2];
+  double l = sqrt(out[0] * out[0] + out[1] * out[1] + out[2] * out[2]);
+  double dot = out[0] * d[0] + out[1] * d[1] + out[2] * d[2];
+  if ((dot < 0) == outward_along_d)
+    l = -l;
+  for (int j = 0; j < 3; j++)
+    out[j] /= l;
+}
+
+// Inside spans of one primitive: the hits sorted along the ray and paired
+// up by parity. Hits on edges shared by two triangles are counted once.
+static void ray_prim_spans(const RayPrim &p, const double o[3], const double d[3], QVector<RayHit> &hits, RaySpans &spans) {
+  double po[3], pd[3], inv_pd[3];
+  for (int i = 0; i < 3; i++) {
+    po[i] = p.inv[i*4] * o[0] + p.inv[i*4 + 1] * o[1] + p.inv[i*4 + 2] * o[2] + p.inv[i*4 + 3];
+    pd[i] = p.inv[i*4] * d[0] + p.inv[i*4 + 1] * d[1] + p.inv[i*4 + 2] * d[2];
+    inv_pd[i] = 1 / pd[i];
+  }
+  hits.resize(0);
+  p.mesh->intersect(po, pd, inv_pd, hits);
+  std::sort(hits.begin(), hits.end());
+
+  int n = 0;
+  for (int i = 0; i < hits.size(); i++) {
+    if (n > 0 && hits[i].t - hits[n - 1].t < 1e-9 * (1 + fabs(hits[i].t))) {
+      const double *a = hits[i].tri->n, *b = hits[n - 1].tri->n;
+      double da = a[0] * pd[0] + a[1] * pd[1] + a[2] * pd[2];
+      double db = b[0] * pd[0] + b[1] * pd[1] + b[2] * pd[2];
+      if ((da < 0) == (db < 0))
+        continue;
+    }
+    hits[n++] = hits[i];
+  }
+
+  for (int i = 0; i + 1 < n; i += 2) {
+    RaySpan s;
+    s.t0 = hits[i].t;
+    s.t1 = hits[i + 1].t;
+    ray_normal(p, hits[i].tri->n, d, false, s.n0);
+    ray_normal(p, hits[i + 1].tri->n, d, true, s.n1);
+    s.cut0 = s.cut1 = false;
+    spans.append(s);
+  }
+}
+
+static void ray_span_start(RaySpan &s, const RaySpan &from, bool end, bool flip) {
+  s.t0 = end ? from.t1 : from.t0;
+  const double *n = end ? from.n1 : from.n0;
+  for (int j = 0; j < 3; j++)
+    s.n0[j] = flip ? -n[j] : n[j];
+  s.cut0 = flip || (end ? from.cut1 : from.cut0);
+}
+
+static void ray_span_end(RaySpan &s, const RaySpan &from, bool end, bool flip) {
+  s.t1 = end ? from.t1 : from.t0;
+  const double *n = end ? from.n1 : from.n0;
+  for (int j = 0; j < 3; j++)
+    s.n1[j] = flip ? -n[j] : n[j];
+  s.cut1 = flip || (end ? from.cut1 : from.cut0);
+}
+
+static void ray_union(const RaySpans &a, const RaySpans &b, RaySpans &r) {
+  int i = 0, j = 0;
+  while (i < a.size() || j < b.size()) {
+    const RaySpan &s = (j == b.size() || (i < a.size() && a[i].t0 <= b[j].t0)) ? a[i++] : b[j++];
+    if (!r.isEmpty() && s.t0 <= r.last().t1) {
+      if (s.t1 > r.last().t1)
+        ray_span_end(r.last(), s, true, false);
+    } else {
+      r.append(s);
+    }
+  }
+}
+
+static void ray_intersection(const RaySpans &a, const RaySpans &b, RaySpans &r) {
+  int i = 0, j = 0;
+  while (i < a.size() && j < b.size()) {
+    const RaySpan &x = a[i], &y = b[j];
+    if (fmax(x.t0, y.t0) < fmin(x.t1, y.t1)) {
+      RaySpan s;
+      ray_span_start(s, x.t0 >= y.t0 ? x : y, false, false);
+      ray_span_end(s, x.t1 <= y.t1 ? x : y, true, false);
+      r.append(s);
+    }
+    if (x.t1 <= y.t1)
+      i++;
+    else
+      j++;
+  }
+}
+
+static void ray_difference(const RaySpans &a, const RaySpans &b, RaySpans &r) {
+  int j = 0;
+  for (int i = 0; i < a.size(); i++) {
+    RaySpan cur = a[i];
+    while (j < b.size() && b[j].t1 <= cur.t0)
+      j++;
+    for (int k = j; k < b.size() && b[k].t0 < cur.t1; k++) {
+      if (b[k].t0 > cur.t0) {
+        RaySpan s = cur;
+        ray_span_end(s, b[k], false, true);
+        r.append(s);
+      }
+      if (b[k].t1 >= cur.t1) {
+        cur.t0 = cur.t1;
+        break;
+      }
+      ray_span_start(cur, b[k], true, true);
+    }
+    if (cur.t0 < cur.t1)
+      r.append(cur);
+  }
+}
+
+// Finds the first surface in front of the origin
+bool RayScene::trace(const double o[3], const double d[3], RaySpan &hit) const {
+  if (nodes.isEmpty())
+    return false;
+  RayScratch *sc = ray_scratch_local();
+  double inv_d[3] = { 1 / d[0], 1 / d[1], 1 / d[2] };
+
+  int i = 0, sp = 0;
+  sc->frames.resize(0);
+  while (1) {
+    const RayNode &n = nodes[i];
+    if (sp == sc->values.size())
+      sc->values.resize(sp + 1);
+    if (!ray_hits_box(n.bbox, o, inv_d)) {
+      sc->values[sp++].resize(0);
+      i += n.size;
+    } else if (n.type == CSGTerm::TYPE_PRIMITIVE) {
+      sc->values[sp].resize(0);
+      ray_prim_spans(prims[n.prim], o, d, sc->hits, sc->values[sp++]);
+      i++;
+    } else {
+      RayScratch::Frame f = { i, false };
+      sc->frames.append(f);
+      i++;
+      continue;
+    }
+
+    while (!sc->frames.isEmpty()) {
+      RayScratch::Frame &f = sc->frames.last();
+      const RayNode &fn = nodes[f.node];
+      if (!f.left_done) {
+        f.left_done = true;
+        // Nothing to intersect with or subtract from: skip the right side
+        if (fn.type != CSGTerm::TYPE_UNION && sc->values[sp - 1].isEmpty()) {
+          i = f.node + fn.size;
+          sc->frames.removeLast();
+          continue;
+        }
+        break;
+      }
+      sc->tmp.resize(0);
+      if (fn.type == CSGTerm::TYPE_UNION)
+        ray_union(sc->values[sp - 2], sc->values[sp - 1], sc->tmp);
+      else if (fn.type == CSGTerm::TYPE_INTERSECTION)
+        ray_intersection(sc->values[sp - 2], sc->values[sp - 1], sc->tmp);
+      else
+        ray_difference(sc->values[sp - 2], sc->values[sp - 1], sc->tmp);
+      qSwap(sc->values[sp - 2], sc->tmp);
+      sp--;
+      sc->frames.removeLast();
+    }
+    if (sc->frames.isEmpty())
+      break;
+  }
+
+  const RaySpans &spans = sc->values[0];
+  for (int k = 0; k < spans.size(); k++) {
+    if (spans[k].t0 > 0) {
+      hit = spans[k];
+      return true;
+    }
+  }
+  return false;
+}
+
+static QThreadStorage<RayScratch*> ray_scratch;
+
+static RayScratch *ray_scratch_local() {
+  if (!ray_scratch.hasLocalData())
+    ray_scratch.setLocalData(new RayScratch());
+  return ray_scratch.localData();
+}
+
+// The camera of GLView::paintGL(): looking along +y from (0, -distance, 0)
+// with z up, the design rotated by rot_x about x and rot_z about z around
+// center.
+struct RayCamera {
+  int width, height;
+  double rot_x, rot_z, distance;
+  double center[3];
+  double r[3][3];
+
+  void prepare() {
+    double ax = rot_x * M_PI / 180, az = rot_z * M_PI / 180;
+    // Inverse of Rx(rot_x) * Rz(rot_z), view to world
+    double rz[3][3] = {
+      { cos(az), sin(az), 0 },
+      { -sin(az), cos(az), 0 },
+      { 0, 0, 1 }
+    };
+    double rx[3][3] = {
+      { 1, 0, 0 },
+      { 0, cos(ax), sin(ax) },
+      { 0, -sin(ax), cos(ax) }
+    };
+    for (int i = 0; i < 3; i++)
+      for (int j = 0; j < 3; j++) {
+        r[i][j] = 0;
+        for (int k = 0; k < 3; k++)
+          r[i][j] += rz[i][k] * rx[k][j];
+      }
+  }
+
+  void ray(double px, double py, double o[3], double d[3]) const {
+    double w_h_ratio = sqrt((double) width / height);
+    double vo[3] = { 0, -distance, 0 };
+    double vd[3] = {
+      (2 * px / width - 1) * w_h_ratio,
+      10,
+      (1 - 2 * py / height) / w_h_ratio
+    };
+    for (int i = 0; i < 3; i++) {
+      o[i] = center[i] + r[i][0] * vo[0] + r[i][1] * vo[1] + r[i][2] * vo[2];
+      d[i] = r[i][0] * vd[0] + r[i][1] * vd[1] + r[i][2] * vd[2];
+    }
+  }
+
+  // Normal back to view space, where the lights of paintGL() are
+  void to_view(const double n[3], double v[3]) const {
+    for (int i = 0; i < 3; i++)
+      v[i] = r[0][i] * n[0] + r[1][i] * n[1] + r[2][i] * n[2];
+  }
+};
+
+// Colors of PolySet::render_surface() and the light setup of paintGL()
+static QRgb ray_shade(const RayCamera &cam, const RaySpan &hit) {
+  double n[3];
+  cam.to_view(hit.n0, n);
+  static const double lights[2][3] = {
+    { -0.57735, -0.57735, +0.57735 },
+    { +0.57735, +0.57735, -0.57735 }
+  };
+  double diffuse = 0.2;
+  for (int i = 0; i < 2; i++)
+    diffuse += fmax(0, n[0] * lights[i][0] + n[1] * lights[i][1] + n[2] * lights[i][2]);
+  diffuse = fmin(diffuse, 1.0);
+  const unsigned char *c = PolySet::color(hit.cut0 ? PolySet::COLORMODE_CUTOUT : PolySet::COLORMODE_MATERIAL, false);
+  return qRgb(c[0] * diffuse, c[1] * diffuse, c[2] * diffuse);
+}
+
+#define RAY_TILE_SIZE 32
+
+struct RayJob {
+  const RayScene *scene;
+  const RayCamera *cam;
+  QRgb *pixels;
+  int stride;
+  int samples;
+  QAtomicInt next_tile;
+};
+
+// Workers take tiles until none are left, which balances the load between
+// empty and busy parts of the image.
+static void ray_worker(RayJob *job) {
+  const RayCamera &cam = *job->cam;
+  int tiles_x = (cam.width + RAY_TILE_SIZE - 1) / RAY_TILE_SIZE;
+  int tiles_y = (cam.height + RAY_TILE_SIZE - 1) / RAY_TILE_SIZE;
+  while (1) {
+    int tile = job->next_tile.fetchAndAddRelaxed(1);
+    if (tile >= tiles_x * tiles_y)
+      return;
+    int x0 = (tile % tiles_x) * RAY_TILE_SIZE, y0 = (tile / tiles_x) * RAY_TILE_SIZE;
+    for (int y = y0; y < qMin(y0 + RAY_TILE_SIZE, cam.height); y++)
+      for (int x = x0; x < qMin(x0 + RAY_TILE_SIZE, cam.width); x++) {
+        int sum[3] = { 0, 0, 0 };
+        for (int s = 0; s < job->samples * job->samples; s++) {
+          double o[3], d[3];
+          cam.ray(x + (s % job->samples + 0.5) / job->samples, y + (s / job->samples + 0.5) / job->samples, o, d);
+          RaySpan hit;
+          QRgb c = job->scene->trace(o, d, hit) ? ray_shade(cam, hit) : qRgb(255, 255, 230);
+          sum[0] += qRed(c), sum[1] += qGreen(c), sum[2] += qBlue(c);
+        }
+        int n = job->samples * job->samples;
+        job->pixels[y * job->stride + x] = qRgb(sum[0] / n, sum[1] / n, sum[2] / n);
+      }
+  }
+}
+
+static QImage ray_render(const RayScene &scene, RayCamera &cam, int samples) {
+  QImage img(cam.width, cam.height, QImage::Format_RGB32);
+  cam.prepare();
+
+  RayJob job;
+  job.scene = &scene;
+  job.cam = &cam;
+  job.pixels = (QRgb*) img.bits();
+  job.stride = img.bytesPerLine() / sizeof(QRgb);
+  job.samples = samples;
+  job.next_tile.store(0);
+
+  QList< QFuture<void> > futures;
+  for (int i = 0; i < QThread::idealThreadCount(); i++)
+    futures.append(QtConcurrent::run(ray_worker, &job));
+  for (int i = 0; i < futures.size(); i++)
+    futures[i].waitForFinished();
+  return img;
+}
+
+QImage raytrace_term(CSGTerm *term, int width, int height, double rot_x, double rot_z, double distance, int samples) {
+  RayScene scene(term);
+  RayCamera cam;
+  cam.width = width;
+  cam.height = height;
+  cam.rot_x = rot_x;
+  cam.rot_z = rot_z;
+  cam.distance = distance;
+  cam.center[0] = cam.center[1] = cam.center[2] = 0;
+
+  // A distance of 0 fits the design into the image
+  if (distance <= 0) {
+    BoundingBox bb;
+    if (!scene.nodes.isEmpty())
+      bb = scene.nodes[0].bbox;
+    double radius = 1;
+    if (!bb.is_empty()) {
+      radius = 0;
+      for (int i = 0; i < 3; i++) {
+        cam.center[i] = (bb.min[i] + bb.max[i]) / 2;
+        radius += (bb.max[i] - bb.min[i]) * (bb.max[i] - bb.min[i]) / 4;
+      }
+      radius = fmax(sqrt(radius), 1e-3);
+    }
+    double w_h_ratio = sqrt((double) width / height);
+    double tan_half = fmin(w_h_ratio, 1 / w_h_ratio) / 10;
+    cam.distance = radius * sqrt(1 + tan_half * tan_half) / tan_half;
+  }
+
+  return ray_render(scene, cam, samples);
+}
+
+// Headless mode: "openscad --raytrace [options] files" writes a PNG next to
+// every file (or to -o / -d) without opening a window or a GL context.
+
+static void raytrace_usage() {
+  fprintf(stderr, "Usage: openscad --raytrace [-o output.png | -d output_dir] [-s WIDTHxHEIGHT]\n"
+      "                         [-r rot_x,rot_z] [-a samples] file.scad ...\n");
+}
+
+struct RaytraceJob {
+  HeadlessImageArgs args;
+  int samples;
+  double rot_x, rot_z;
+  int failed;
+
+  RaytraceJob() : args(512), samples(1), rot_x(35), rot_z(25), failed(0) {
+  }
+};
+
+static void raytrace_job(void *vp) {
+  RaytraceJob *job = (RaytraceJob*) vp;
+  const HeadlessImageArgs &args = job->args;
+  foreach(const QString &file, args.files) {
+    QElapsedTimer timer;
+    timer.start();
+    QString output = args.output(file, QString());
+    CompiledDesign *d = compile_file(file);
+    bool ok = d && d->root_node;
+    if (ok) {
+      QImage img = raytrace_term(d->root_raw_term, args.width, args.height, job->rot_x, job->rot_z, 0, job->samples);
+      if (!img.save(output, "PNG")) {
+        fprintf(stderr, "Can't write `%s'.\n", output.toLocal8Bit().data());
+        ok = false;
+      }
+    }
+    delete d;
+    if (!ok) {
+      job->failed++;
+      continue;
+    }
+    printf("%s: %.0f ms\n", output.toLocal8Bit().data(), timer.nsecsElapsed() / 1e6);
+  }
+}
+
+int raytrace_main(int argc, char **argv) {
+  QCoreApplication app(argc, argv);
+  RaytraceJob job;
+
+  for (int i = 2; i < argc; i++) {
+    QString arg = argv[i];
+    if (arg == "-r" && i + 1 < argc) {
+      if (sscanf(argv[++i], "%lf,%lf", &job.rot_x, &job.rot_z) != 2) {
+        raytrace_usage();
+        return 1;
+      }
+    } else if (arg == "-a" && i + 1 < argc) {
+      job.samples = qBound(1, atoi(argv[++i]), 8);
+    } else if (!job.args.parse(argc, argv, i)) {
+      raytrace_usage();
+      return 1;
+    }
+  }
+  if (!job.args.valid(1)) {
+    raytrace_usage();
+    return 1;
+  }
+
+  headless_run(raytrace_job, &job);
+  return job.failed > 0 ? 1 : 0;
+}
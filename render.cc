@@ -24,6 +24,7 @@
 #include <QProgressDialog>
 #include <QApplication>
 #include <QTime>
+#include <QtConcurrentRun>
 
 class RenderModule : public AbstractModule {
 public:
@@ -36,10 +37,13 @@ public:
 class RenderNode : public AbstractNode {
 public:
   int convexity;
+  bool mesh_engine;
 
-  RenderNode(const ModuleInstanciation *mi) : AbstractNode(mi), convexity(1) {
+  RenderNode(const ModuleInstanciation *mi) : AbstractNode(mi), convexity(1), mesh_engine(false) {
   }
-  virtual CGAL_Nef_polyhedron render_cgal_nef_polyhedron() const;
+  CGAL_Nef_operand render_cgal_nef_union() const;
+  virtual CGAL_Nef_operand render_cgal_nef_polyhedron() const;
+  virtual bool render_mesh(CGAL_Mesh &M) const;
   CSGTerm *render_csg_term(double m[16], QVector<CSGTerm*> *highlights, QVector<CSGTerm*> *background) const;
   virtual QString dump(QString indent) const;
 };
@@ -47,7 +51,7 @@ public:
 AbstractNode *RenderModule::evaluate(const Context *ctx, const ModuleInstanciation *inst) const {
   RenderNode *node = new RenderNode(inst);
 
-  QVector<QString> argnames = QVector<QString>() << "convexity";
+  QVector<QString> argnames = QVector<QString>() << "convexity" << "engine" << "snap";
   QVector<Expression*> argexpr;
 
   Context c(ctx);
@@ -57,12 +61,28 @@ AbstractNode *RenderModule::evaluate(const Context *ctx, const ModuleInstanciati
   if (v.type == Value::NUMBER)
     node->convexity = (int) v.num;
 
+  // engine = "mesh" selects the corefinement based mesh engine, the default
+  // for a whole design can be set using the $engine variable.
+  v = c.lookup_variable("engine");
+  if (v.type != Value::STRING)
+    v = c.lookup_variable("$engine");
+  if (v.type == Value::STRING)
+    node->mesh_engine = v.text == "mesh";
+
+  v = c.lookup_variable("snap");
+  double snap_grid = 0;
+  if (v.type == Value::NUMBER && v.num > 0)
+    snap_grid = v.num;
+
   foreach(ModuleInstanciation *v, inst->children) {
     AbstractNode *n = v->evaluate(inst->ctx);
     if (n != NULL)
       node->children.append(n);
   }
 
+  if (snap_grid > 0)
+    node->set_snap_grid(snap_grid);
+
   return node;
 }
 
@@ -71,30 +91,62 @@ void register_builtin_render() {
 }
 
 
-CGAL_Nef_polyhedron RenderNode::render_cgal_nef_polyhedron() const {
+CGAL_Nef_operand RenderNode::render_cgal_nef_union() const {
+  TraceSpan span("render_cgal_nef_polyhedron", this);
   QString cache_id = mk_cache_id();
-  if (cgal_nef_cache.contains(cache_id)) {
+  CGAL_Nef_operand N;
+  if (cgal_nef_cache_lookup(cache_id, N)) {
+    profile_cache_hit(this);
     progress_report();
-    return *cgal_nef_cache[cache_id];
+    return N;
   }
 
-  bool first = true;
-  CGAL_Nef_polyhedron N;
+  QList<CGAL_Nef_operand> child_N = render_cgal_nef_children();
+  QElapsedTimer timer;
+  timer.start();
+  N = cgal_nef_reduce(child_N, CSGTerm::TYPE_UNION);
+  if (progress_cancelled())
+    return N;
+  if (snap_grid > 0)
+    cgal_nef_snap(N, snap_grid);
+  profile_node(this, timer.nsecsElapsed(), cgal_nef_vertices(child_N), N.N.number_of_vertices());
+
+  cgal_nef_cache_insert(cache_id, N);
+  progress_report();
+  return N;
+}
 
-  foreach(AbstractNode * v, children) {
-    if (v->modinst->tag_background)
-      continue;
-    if (first) {
-      N = v->render_cgal_nef_polyhedron();
-      first = false;
-    } else {
-      N += v->render_cgal_nef_polyhedron();
-    }
+bool RenderNode::render_mesh(CGAL_Mesh &M) const {
+  TraceSpan span("render_mesh", this);
+  QString cache_id = mk_cache_id();
+  if (cgal_mesh_cache_lookup(cache_id, M)) {
+    progress_report();
+    return true;
   }
 
-  cgal_nef_cache.insert(cache_id, new CGAL_Nef_polyhedron(N), N.number_of_vertices());
+  if (!render_mesh_children(M, CSGTerm::TYPE_UNION))
+    return false;
+  if (snap_grid > 0)
+    cgal_mesh_snap(M, snap_grid);
+
+  cgal_mesh_cache_insert(cache_id, M);
   progress_report();
-  return N;
+  return true;
+}
+
+CGAL_Nef_operand RenderNode::render_cgal_nef_polyhedron() const {
+  if (mesh_engine) {
+    CGAL_Mesh M;
+    if (render_mesh(M)) {
+      // This isn't cached, but the parent may combine it on another thread
+      CGAL_Nef_operand N(cgal_mesh_to_nef(M));
+      cgal_nef_make_exact(N.N);
+      return N;
+    }
+    if (!progress_cancelled())
+      PRINT("WARNING: Input of render(engine = \"mesh\") isn't a closed manifold mesh, falling back to Nef polyhedra.");
+  }
+  return render_cgal_nef_union();
 }
 
 static void report_func(const class AbstractNode*, void *vp, int mark) {
@@ -104,52 +156,71 @@ static void report_func(const class AbstractNode*, void *vp, int mark) {
   QString label;
   label.sprintf("Rendering Polygon Mesh using CGAL (%d/%d)", mark, progress_report_count);
   pd->setLabelText(label);
-  QApplication::processEvents();
 }
 
-CSGTerm *RenderNode::render_csg_term(double m[16], QVector<CSGTerm*> *highlights, QVector<CSGTerm*> *background) const {
-  QString key = mk_cache_id();
-  if (PolySet::ps_cache.contains(key))
-    return AbstractPolyNode::render_csg_term_from_ps(m, highlights, background,
-          PolySet::ps_cache[key]->ps->link(), modinst, idx);
-
-  CGAL_Nef_polyhedron N;
-
-  QString cache_id = mk_cache_id();
-  if (cgal_nef_cache.contains(cache_id)) {
-    N = *cgal_nef_cache[cache_id];
-  } else {
-    PRINT("Processing uncached render statement...");
-    // PRINTA("Cache ID: %1", cache_id);
-    QApplication::processEvents();
-
-    QTime t;
-    t.start();
-
-    QProgressDialog *pd = new QProgressDialog("Rendering Polygon Mesh using CGAL...", QString(), 0, 100);
-    pd->setValue(0);
-    pd->setAutoClose(false);
-    pd->show();
-    QApplication::processEvents();
-
-    progress_report_prep((AbstractNode*)this, report_func, pd);
-    N = this->render_cgal_nef_polyhedron();
-    progress_report_fin();
+static void progress_run_job(ProgressJob *job, void (*f)(void *vp), void *vp) {
+  ProgressJobScope scope(job);
+  f(vp);
+}
 
-    int s = t.elapsed() / 1000;
-    PRINTF("..rendering time: %d hours, %d minutes, %d seconds", s / (60 * 60), (s / 60) % 60, s % 60);
+// Runs f(vp) as a job of its own on a worker thread. Meanwhile the GUI thread
+// shows a modal progress dialog, forwards the progress reports of the workers
+// and keeps processing events (including the console messages sent by the
+// workers).
+// Returns false if the render has been cancelled using the dialog.
+bool progress_run(AbstractNode *root, void (*f)(void *vp), void *vp) {
+  QProgressDialog *pd = new QProgressDialog("Rendering Polygon Mesh using CGAL...", "Cancel", 0, 100);
+  pd->setWindowModality(Qt::ApplicationModal);
+  pd->setMinimumDuration(0);
+  pd->setValue(0);
+  pd->setAutoClose(false);
+  pd->setAutoReset(false);
+  pd->show();
+  QApplication::processEvents();
 
-    delete pd;
+  ProgressJob job;
+  progress_report_prep(root, report_func, pd);
+  QFuture<void> future = QtConcurrent::run(progress_run_job, &job, f, vp);
+  while (!future.isFinished()) {
+    progress_report_flush();
+    if (pd->wasCanceled() && !job.cancelled()) {
+      job.cancel();
+      pd->setLabelText("Cancelling after the current CGAL operation...");
+    }
+    QApplication::processEvents(QEventLoop::AllEvents, 20);
+    QThread::msleep(10);
   }
+  bool cancelled = job.cancelled();
+  progress_report_fin();
 
-  if (!N.is_simple()) {
-    PRINTF("WARNING: Result of render() isn't a single polyeder or otherwise invalid! Modify your design..");
-    return NULL;
-  }
+  delete pd;
+  QApplication::processEvents();
+  return !cancelled;
+}
 
-  PolySet *ps = new PolySet();
-  ps->convexity = convexity;
+// render_node is NULL for subtrees that are rendered automatically
+struct RenderNodeJob {
+  const AbstractNode *node;
+  const RenderNode *render_node;
+  bool mesh_engine;
+  bool have_mesh;
+  CGAL_Mesh M;
+  CGAL_Nef_operand N;
+};
 
+static void render_node_job(void *vp) {
+  RenderNodeJob *job = (RenderNodeJob*) vp;
+  if (job->mesh_engine)
+    job->have_mesh = job->node->render_mesh(job->M);
+  if (job->mesh_engine && !job->have_mesh && !progress_cancelled())
+    PRINT("WARNING: Input of render(engine = \"mesh\") isn't a closed manifold mesh, falling back to Nef polyhedra.");
+  if (!job->have_mesh)
+    job->N = job->render_node ? job->render_node->render_cgal_nef_union() : job->node->render_cgal_nef_polyhedron();
+}
+
+// Appends the facets of a simple Nef polyhedron, the polygons the STL export
+// writes as well
+void nef_to_polyset(PolySet *ps, const CGAL_Nef_polyhedron &N) {
   CGAL_Polyhedron P;
   N.convert_to_Polyhedron(P);
 
@@ -170,8 +241,83 @@ CSGTerm *RenderNode::render_csg_term(double m[16], QVector<CSGTerm*> *highlights
       ps->append_vertex(x, y, z);
     } while (hc != hc_end);
   }
+}
 
-  PolySet::ps_cache.insert(key, new PolySetPtr(ps->link()));
+// Renders the node with CGAL, or takes the result from the polyset cache, and
+// returns it as a single primitive for the OpenCSG preview.
+static CSGTerm *render_csg_term_via_cgal(const AbstractNode *node, const RenderNode *render_node, bool mesh_engine,
+    int convexity, double m[16], QVector<CSGTerm*> *highlights, QVector<CSGTerm*> *background) {
+  const ModuleInstanciation *modinst = node->modinst;
+  int idx = node->idx;
+  QString key = node->mk_cache_id();
+  {
+    QMutexLocker locker(&PolySet::ps_cache_mutex);
+    if (PolySet::ps_cache.contains(key))
+      return AbstractPolyNode::render_csg_term_from_ps(m, highlights, background,
+            PolySet::ps_cache[key]->ps->link(), modinst, idx);
+  }
+
+  CGAL_Nef_operand N;
+  CGAL_Mesh M;
+  bool have_mesh = false;
+
+  if (mesh_engine)
+    have_mesh = AbstractNode::cgal_mesh_cache_lookup(key, M);
+  if (!have_mesh && !AbstractNode::cgal_nef_cache_lookup(key, N)) {
+    PRINT("Processing uncached render statement...");
+    // PRINTA("Cache ID: %1", cache_id);
+
+    QTime t;
+    t.start();
+
+    RenderNodeJob job;
+    job.node = node;
+    job.render_node = render_node;
+    job.mesh_engine = mesh_engine;
+    job.have_mesh = false;
+
+    // Background compiles already run on a worker thread and have no progress
+    // dialog. They are cancelled by a newer compile instead.
+    cgal_snap_moved.store(0);
+    if (progress_in_gui_thread()) {
+      QApplication::processEvents();
+      if (!progress_run((AbstractNode*)node, render_node_job, &job)) {
+        PRINT("..rendering cancelled, the render() statement is ignored.");
+        return NULL;
+      }
+    } else {
+      render_node_job(&job);
+      if (progress_cancelled())
+        return NULL;
+    }
+    have_mesh = job.have_mesh;
+    M = job.M;
+    N = job.N;
+
+    int s = t.elapsed() / 1000;
+    PRINTF("..rendering time: %d hours, %d minutes, %d seconds", s / (60 * 60), (s / 60) % 60, s % 60);
+    if (node->snap_grid > 0)
+      PRINTF("..snap rounding moved %d vertices to a %g grid", cgal_snap_moved.fetchAndStoreOrdered(0), node->snap_grid);
+  }
+
+  PolySet *ps = NULL;
+  if (have_mesh) {
+    ps = cgal_mesh_to_polyset(M);
+    ps->convexity = convexity;
+  } else {
+    if (!N.N.is_simple()) {
+      PRINTF("WARNING: Result of render() isn't a single polyeder or otherwise invalid! Modify your design..");
+      return NULL;
+    }
+    ps = new PolySet();
+    ps->convexity = convexity;
+    nef_to_polyset(ps, N.N);
+  }
+
+  {
+    QMutexLocker locker(&PolySet::ps_cache_mutex);
+    PolySet::ps_cache.insert(key, new PolySetPtr(ps->link()));
+  }
 
   CSGTerm *term = new CSGTerm(ps, m, QString("n%1").arg(idx));
   if (modinst->tag_highlight && highlights)
@@ -183,10 +329,39 @@ CSGTerm *RenderNode::render_csg_term(double m[16], QVector<CSGTerm*> *highlights
   return term;
 }
 
+CSGTerm *RenderNode::render_csg_term(double m[16], QVector<CSGTerm*> *highlights, QVector<CSGTerm*> *background) const {
+  return render_csg_term_via_cgal(this, this, mesh_engine, convexity, m, highlights, background);
+}
+
+// Subtrees whose normalized CSG products would explode are rendered with
+// CGAL instead, as if they were wrapped in render(). Background compiles run
+// on the compile worker, so the GUI stays responsive meanwhile, and the
+// result is cached for the following compiles.
+double csg_autorender_limit = 1000;
+
+CSGTerm *AbstractNode::render_csg_term_autorender(CSGTerm *term, double m[16]) const {
+  if (!term || csg_autorender_limit <= 0 || term->products <= csg_autorender_limit)
+    return term;
+  // Big unions aren't expanded by the normalization, OpenCSG draws them as they are
+  if (term->products <= 2 * term->primitives)
+    return term;
+
+  PRINTF("Subtree n%d would normalize to about %.0f CSG products, rendering it with CGAL...", idx, term->products);
+  CSGTerm *rendered = render_csg_term_via_cgal(this, NULL, false, term->convexity, m, NULL, NULL);
+  if (!rendered)
+    return term;
+  term->unlink();
+  return rendered;
+}
 
 QString RenderNode::dump(QString indent) const {
   if (dump_cache.isEmpty()) {
-    QString text = indent + QString("n%1: ").arg(idx) + QString("render() {\n");
+    QString args;
+    if (mesh_engine)
+      args += "engine = \"mesh\"";
+    if (snap_grid > 0)
+      args += QString(args.isEmpty() ? "" : ", ") + QString("snap = %1").arg(snap_grid);
+    QString text = indent + QString("n%1: ").arg(idx) + QString("render(%1) {\n").arg(args);
     foreach(AbstractNode *v, children)
     text += v->dump(indent + QString("\t"));
     ((AbstractNode*)this)->dump_cache = text + indent + "}\n";
@@ -0,0 +1,118 @@
+/*
+ *  OpenSCAD (www.openscad.at)
+ *  Copyright (C) 2009  Clifford Wolf <clifford@clifford.at>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#define INCLUDE_ABSTRACT_NODE_DETAILS
+
+#include "openscad.h"
+
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+
+bool trace_enabled;
+
+struct TraceEvent {
+  const char *name;
+  QString detail;
+  qint64 start, end;
+  int tid;
+};
+
+// Tracing is meant for single runs, not for leaving it on for hours
+#define TRACE_MAX_EVENTS 1000000
+
+static QMutex trace_mutex;
+static QElapsedTimer trace_clock;
+static QVector<TraceEvent> trace_events;
+static QHash<Qt::HANDLE, int> trace_threads;
+static int trace_next_tid = 2;
+
+void trace_reset() {
+  QMutexLocker locker(&trace_mutex);
+  trace_events.clear();
+  trace_threads.clear();
+  trace_next_tid = 2;
+  trace_clock.start();
+}
+
+void TraceSpan::begin(const char *name, const AbstractNode *node) {
+  this->name = name;
+  if (node)
+    detail = QString("n%1: %2()").arg(node->idx).arg(node->modinst->modname.isEmpty() ? QString("group") : node->modinst->modname);
+  QMutexLocker locker(&trace_mutex);
+  if (!trace_clock.isValid())
+    trace_clock.start();
+  start = trace_clock.nsecsElapsed();
+}
+
+void TraceSpan::end() {
+  QMutexLocker locker(&trace_mutex);
+  if (trace_events.size() >= TRACE_MAX_EVENTS)
+    return;
+
+  // The GUI thread is always thread 1, the workers are numbered from 2
+  Qt::HANDLE thread = QThread::currentThreadId();
+  if (!trace_threads.contains(thread))
+    trace_threads[thread] = progress_in_gui_thread() ? 1 : trace_next_tid++;
+
+  TraceEvent ev;
+  ev.name = name;
+  ev.detail = detail;
+  ev.start = start;
+  ev.end = trace_clock.nsecsElapsed();
+  ev.tid = trace_threads[thread];
+  trace_events.append(ev);
+}
+
+// Writes the spans in the Chrome trace event format ("X" complete events,
+// times in microseconds), as understood by chrome://tracing and Perfetto.
+QByteArray trace_json() {
+  QMutexLocker locker(&trace_mutex);
+  QJsonArray events;
+
+  QHash<Qt::HANDLE, int>::const_iterator it;
+  for (it = trace_threads.constBegin(); it != trace_threads.constEnd(); ++it) {
+    QJsonObject meta, args;
+    args["name"] = it.value() == 1 ? QString("GUI") : QString("worker %1").arg(it.value() - 1);
+    meta["name"] = "thread_name";
+    meta["ph"] = "M";
+    meta["pid"] = 1;
+    meta["tid"] = it.value();
+    meta["args"] = args;
+    events.append(meta);
+  }
+
+  foreach(const TraceEvent &ev, trace_events) {
+    QJsonObject e;
+    e["name"] = ev.detail.isEmpty() ? QString(ev.name) : QString("%1 %2").arg(ev.name, ev.detail);
+    e["cat"] = "openscad";
+    e["ph"] = "X";
+    e["ts"] = ev.start / 1000.0;
+    e["dur"] = (ev.end - ev.start) / 1000.0;
+    e["pid"] = 1;
+    e["tid"] = ev.tid;
+    events.append(e);
+  }
+
+  QJsonObject root;
+  root["traceEvents"] = events;
+  root["displayTimeUnit"] = "ms";
+  return QJsonDocument(root).toJson(QJsonDocument::Compact);
+}
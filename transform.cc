@@ -22,6 +22,8 @@
 
 #include "openscad.h"
 
+#include <QtConcurrentRun>
+
 enum transform_type_e {
   SCALE,
   ROTATE,
@@ -44,7 +46,8 @@ public:
 
   TransformNode(const ModuleInstanciation *mi) : AbstractNode(mi) {
   }
-  virtual CGAL_Nef_polyhedron render_cgal_nef_polyhedron() const;
+  virtual CGAL_Nef_operand render_cgal_nef_polyhedron() const;
+  virtual bool render_mesh(CGAL_Mesh &M) const;
   virtual CSGTerm *render_csg_term(double m[16], QVector<CSGTerm*> *highlights, QVector<CSGTerm*> *background) const;
   virtual QString dump(QString indent) const;
 };
@@ -138,33 +141,235 @@ AbstractNode *TransformModule::evaluate(const Context *ctx, const ModuleInstanci
 }
 
 
-CGAL_Nef_polyhedron TransformNode::render_cgal_nef_polyhedron() const {
+// Smallest singular value of the linear part of c, i.e. the square root of the
+// smallest eigenvalue of the symmetric matrix A^T A (closed form for 3x3).
+static double min_singular_value(const double c[16]) {
+  double b[3][3];
+  for (int i = 0; i < 3; i++)
+    for (int j = 0; j < 3; j++)
+      b[i][j] = c[i*4]*c[j*4] + c[i*4+1]*c[j*4+1] + c[i*4+2]*c[j*4+2];
+
+  double q = (b[0][0] + b[1][1] + b[2][2]) / 3;
+  double p1 = b[0][1]*b[0][1] + b[0][2]*b[0][2] + b[1][2]*b[1][2];
+  double p2 = (b[0][0]-q)*(b[0][0]-q) + (b[1][1]-q)*(b[1][1]-q) + (b[2][2]-q)*(b[2][2]-q) + 2*p1;
+  double p = sqrt(p2 / 6);
+  if (p == 0)
+    return sqrt(q);
+  for (int i = 0; i < 3; i++)
+    b[i][i] -= q;
+  double r = (b[0][0] * (b[1][1]*b[2][2] - b[1][2]*b[2][1]) -
+      b[0][1] * (b[1][0]*b[2][2] - b[1][2]*b[2][0]) +
+      b[0][2] * (b[1][0]*b[2][1] - b[1][1]*b[2][0])) / (2*p*p*p);
+  double phi = acos(fmax(-1.0, fmin(1.0, r))) / 3;
+  return sqrt(fmax(0.0, q + 2*p*cos(phi + 2*M_PI/3)));
+}
+
+struct TransformedLeaf {
+  const AbstractPolyNode *node;
+  double m[16];
+  QString cache_id;
+};
+
+// Collects the leaves below a tree of transformations together with their
+// accumulated transformation, and the transformations themselves in post
+// order. Returns false if the tree contains anything else, or a
+// transformation that shrinks the mesh in some direction (the polyset to Nef
+// conversion merges vertices closer than 0.001).
+static bool collect_transformed_leaves(const AbstractNode *node, const double c[16],
+    QList<TransformedLeaf> &leaves, QList<const TransformNode*> &transforms) {
+  if (const TransformNode *tn = dynamic_cast<const TransformNode*>(node)) {
+    double x[16];
+    for (int i = 0; i < 16; i++) {
+      int c_row = i % 4;
+      int m_col = i / 4;
+      x[i] = 0;
+      for (int j = 0; j < 4; j++)
+        x[i] += c[c_row + j * 4] * tn->m[m_col * 4 + j];
+    }
+    foreach(AbstractNode *v, tn->children) {
+      if (!v->modinst->tag_background && !collect_transformed_leaves(v, x, leaves, transforms))
+        return false;
+    }
+    transforms.append(tn);
+    return true;
+  }
+
+  const AbstractPolyNode *pn = dynamic_cast<const AbstractPolyNode*>(node);
+  if (!pn)
+    return false;
+  if (c[3] != 0 || c[7] != 0 || c[11] != 0 || c[15] != 1)
+    return false;
+  if (min_singular_value(c) < 1 - 1e-9)
+    return false;
+
+  // The cache ids are created here, so the workers never write to the dump
+  // caches of the nodes.
+  TransformedLeaf leaf;
+  leaf.node = pn;
+  leaf.cache_id = "transformed_leaf(";
+  for (int i = 0; i < 16; i++) {
+    leaf.m[i] = c[i];
+    leaf.cache_id += QString::number(c[i], 'g', 17) + (i < 15 ? "," : ")");
+  }
+  leaf.cache_id += pn->mk_cache_id();
+  leaves.append(leaf);
+  return true;
+}
+
+static CGAL_Nef_operand render_transformed_leaf(ProgressJob *job, const TransformedLeaf &leaf) {
+  ProgressJobScope scope(job);
+  TraceSpan span("render_cgal_nef_polyhedron", leaf.node);
+  const double *c = leaf.m;
+  CGAL_Nef_operand N;
+  if (AbstractNode::cgal_nef_cache_lookup(leaf.cache_id, N)) {
+    profile_cache_hit(leaf.node);
+    leaf.node->progress_report();
+    return N;
+  }
+  if (progress_cancelled())
+    return N;
+
+  QElapsedTimer timer;
+  timer.start();
+  PolySet *ps = leaf.node->render_polyset(AbstractPolyNode::RENDER_CGAL);
+  if (!ps)
+    return N;
+
+  // Mirroring turns the mesh inside out, so the polygons are reversed
+  double det = c[0] * (c[5]*c[10] - c[9]*c[6]) -
+      c[4] * (c[1]*c[10] - c[9]*c[2]) +
+      c[8] * (c[1]*c[6] - c[5]*c[2]);
+
+  PolySet *tps = new PolySet();
+  tps->convexity = ps->convexity;
+  int vertices_in = 0;
+  for (int i = 0; i < ps->polygons.size(); i++) {
+    const PolySet::Polygon *poly = &ps->polygons[i];
+    tps->append_poly();
+    for (int j = 0; j < poly->size(); j++) {
+      const PolySet::Point *p = &poly->at(det < 0 ? poly->size() - j - 1 : j);
+      tps->append_vertex(
+          c[0]*p->x + c[4]*p->y + c[ 8]*p->z + c[12],
+          c[1]*p->x + c[5]*p->y + c[ 9]*p->z + c[13],
+          c[2]*p->x + c[6]*p->y + c[10]*p->z + c[14]);
+    }
+    vertices_in += poly->size();
+  }
+  ps->unlink();
+
+  N = CGAL_Nef_operand(tps->render_cgal_nef_polyhedron(), tps->bounding_box());
+  tps->unlink();
+  profile_node(leaf.node, timer.nsecsElapsed(), vertices_in, N.N.number_of_vertices());
+
+  AbstractNode::cgal_nef_cache_insert(leaf.cache_id, N);
+  leaf.node->progress_report();
+  return N;
+}
+
+// Same scheduling as AbstractNode::render_cgal_nef_children()
+static QList<CGAL_Nef_operand> render_transformed_leaves(const QList<TransformedLeaf> &leaves) {
+  QList<CGAL_Nef_operand> results;
+  if (cgal_render_threads <= 1 || leaves.size() < 2) {
+    foreach(const TransformedLeaf &leaf, leaves) {
+      if (progress_cancelled())
+        break;
+      results.append(render_transformed_leaf(progress_job_current(), leaf));
+    }
+    return results;
+  }
+
+  QList< QFuture<CGAL_Nef_operand> > futures;
+  for (int i = 1; i < leaves.size(); i++)
+    futures.append(QtConcurrent::run(render_transformed_leaf, progress_job_current(), leaves[i]));
+
+  results.append(render_transformed_leaf(progress_job_current(), leaves[0]));
+
+  for (int i = 0; i < futures.size(); i++)
+    results.append(progress_wait(futures[i]));
+  return results;
+}
+
+CGAL_Nef_operand TransformNode::render_cgal_nef_polyhedron() const {
+  TraceSpan span("render_cgal_nef_polyhedron", this);
   QString cache_id = mk_cache_id();
-  if (cgal_nef_cache.contains(cache_id)) {
+  CGAL_Nef_operand N;
+  if (cgal_nef_cache_lookup(cache_id, N)) {
+    profile_cache_hit(this);
     progress_report();
-    return *cgal_nef_cache[cache_id];
+    return N;
   }
 
-  CGAL_Nef_polyhedron N;
+  // The exact transformation of a Nef polyhedron touches every vertex with
+  // rational arithmetic and, for rotations, blows up the size of the
+  // coordinates. So when we only transform plain polygon meshes, the matrix
+  // is applied to the meshes before the Nef polyhedra are created.
+  double identity[16];
+  for (int i = 0; i < 16; i++)
+    identity[i] = i % 5 == 0 ? 1.0 : 0.0;
+
+  QList<TransformedLeaf> leaves;
+  QList<const TransformNode*> transforms;
+  bool leaf_path = collect_transformed_leaves(this, identity, leaves, transforms);
+  QList<CGAL_Nef_operand> child_N = leaf_path ? render_transformed_leaves(leaves) : render_cgal_nef_children();
+  int vertices_in = cgal_nef_vertices(child_N);
+  QElapsedTimer timer;
+  timer.start();
+  N = cgal_nef_reduce(child_N, CSGTerm::TYPE_UNION);
+
+  if (!leaf_path) {
+    CGAL_Aff_transformation t(
+            m[0], m[4], m[ 8], m[12],
+            m[1], m[5], m[ 9], m[13],
+            m[2], m[6], m[10], m[14], m[15]);
+    N.N.transform(t);
+    N.bb = N.bb.transformed(m);
+  }
 
-  foreach(AbstractNode *v, children) {
-    if (v->modinst->tag_background)
-      continue;
-    N += v->render_cgal_nef_polyhedron();
+  if (progress_cancelled())
+    return N;
+  // The leaf path skips the nested transformations, so the combined result
+  // is rounded to the finest grid any of them uses
+  double grid = snap_grid;
+  if (leaf_path) {
+    foreach(const TransformNode *tn, transforms) {
+      if (tn->snap_grid > 0 && (grid <= 0 || tn->snap_grid < grid))
+        grid = tn->snap_grid;
+    }
   }
+  if (grid > 0)
+    cgal_nef_snap(N, grid);
+  profile_node(this, timer.nsecsElapsed(), vertices_in, N.N.number_of_vertices());
+
+  cgal_nef_cache_insert(cache_id, N);
+  if (leaf_path) {
+    foreach(const TransformNode *tn, transforms)
+    tn->progress_report();
+  } else {
+    progress_report();
+  }
+  return N;
+}
 
-  CGAL_Aff_transformation t(
-          m[0], m[4], m[ 8], m[12],
-          m[1], m[5], m[ 9], m[13],
-          m[2], m[6], m[10], m[14], m[15]);
-  N.transform(t);
 
-  cgal_nef_cache.insert(cache_id, new CGAL_Nef_polyhedron(N), N.number_of_vertices());
+bool TransformNode::render_mesh(CGAL_Mesh &M) const {
+  TraceSpan span("render_mesh", this);
+  QString cache_id = mk_cache_id();
+  if (cgal_mesh_cache_lookup(cache_id, M)) {
+    progress_report();
+    return true;
+  }
+
+  if (!render_mesh_children(M, CSGTerm::TYPE_UNION))
+    return false;
+  cgal_mesh_transform(M, m);
+  if (snap_grid > 0)
+    cgal_mesh_snap(M, snap_grid);
+
+  cgal_mesh_cache_insert(cache_id, M);
   progress_report();
-  return N;
+  return true;
 }
 
-
 CSGTerm *TransformNode::render_csg_term(double c[16], QVector<CSGTerm*> *highlights, QVector<CSGTerm*> *background) const {
   double x[16];
 
@@ -186,6 +391,7 @@ CSGTerm *TransformNode::render_csg_term(double c[16], QVector<CSGTerm*> *highlig
       t1 = new CSGTerm(CSGTerm::TYPE_UNION, t1, t2);
     }
   }
+  t1 = render_csg_term_autorender(t1, c);
   if (t1 && modinst->tag_highlight && highlights)
     highlights->append(t1->link());
   if (t1 && modinst->tag_background && background) {